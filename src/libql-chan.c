@@ -0,0 +1,356 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <errno.h>
+#include <pthread.h>
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+typedef struct chanWaiter chanWaiter;
+
+/* A coroutine waiting on an MPMC channel, on its own stack. A waiting
+ * receiver is handed items directly into its buffer. A waiting sender is
+ * only woken to try again. Waiters are woken with the channel locked, and
+ * relock it before they return, so a waker never outlives the waiter. */
+struct chanWaiter {
+  chanWaiter  *next;
+  qlState     *state;
+  qlParameter *items;   /* Receivers: where to store items */
+  size_t       count;   /* Receivers: the room in items, then how many came */
+  bool         done;
+};
+
+typedef struct {
+  chanWaiter *head;
+  chanWaiter *tail;
+} chanQueue;
+
+/* Items live in a ring of size slots; head and tail only ever grow. An SPSC
+ * channel is lock free: the sender owns tail and the receiver head, and
+ * each parks in its waiter slot when the ring is full (or empty). */
+struct qlChannel {
+  size_t          size;
+  bool            spsc;
+  bool            closed;
+  uint64_t        head;     /* The next item to receive */
+  uint64_t        tail;     /* The next item to send */
+
+  qlState        *sender;   /* SPSC: the waiting sender */
+  qlState        *receiver; /* SPSC: the waiting receiver */
+
+  pthread_mutex_t lock;     /* MPMC: protects everything */
+  chanQueue       senders;
+  chanQueue       receivers;
+
+  qlParameter     ring[];
+};
+
+static bool
+chan_waits(qlState *state)
+{
+  return state && state->sched;
+}
+
+static void
+queue_push(chanQueue *q, chanWaiter *w)
+{
+  w->next = NULL;
+  if (q->tail)
+    q->tail->next = w;
+  else
+    q->head = w;
+  q->tail = w;
+}
+
+static chanWaiter *
+queue_pop(chanQueue *q)
+{
+  chanWaiter *w = q->head;
+
+  if (w) {
+    q->head = w->next;
+    if (!q->head)
+      q->tail = NULL;
+  }
+
+  return w;
+}
+
+/* Wakes a waiter, which must already be off its queue. */
+static void
+chan_wake(chanWaiter *w)
+{
+  w->done = true;
+  sched_wake(w->state);
+}
+
+/* Queues the calling coroutine and parks it until it's woken. The channel
+ * is locked on entry and on return. */
+static void
+chan_wait(qlChannel *chan, chanQueue *q, chanWaiter *w)
+{
+  queue_push(q, w);
+  do {
+    pthread_mutex_unlock(&chan->lock);
+    sched_park(w->state);
+    pthread_mutex_lock(&chan->lock);
+  } while (!w->done);
+}
+
+static void
+chan_free(void *mem)
+{
+  qlChannel *chan = mem;
+
+  pthread_mutex_destroy(&chan->lock);
+}
+
+qlChannel *
+ql_chan_new(void *parent, size_t capacity, qlFlags flags)
+{
+  qlChannel *chan;
+
+  if ((flags & QL_CHAN_SPSC) && capacity == 0)
+    capacity = 1;
+
+  chan = sc_malloc0(parent,
+                    sizeof(qlChannel) + capacity * sizeof(qlParameter),
+                    "qlChannel");
+  if (!chan)
+    return NULL;
+
+  chan->size = capacity;
+  chan->spsc = flags & QL_CHAN_SPSC;
+  pthread_mutex_init(&chan->lock, NULL);
+  sc_destructor_set(chan, chan_free);
+  return chan;
+}
+
+static size_t
+spsc_send(qlState *state, qlChannel *chan, const qlParameter *items,
+          size_t count)
+{
+  uint64_t head, tail = __atomic_load_n(&chan->tail, __ATOMIC_RELAXED);
+  size_t sent = 0, n;
+
+  while (sent < count) {
+    if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE)) {
+      sched_errno(EPIPE);
+      break;
+    }
+
+    head = __atomic_load_n(&chan->head, __ATOMIC_ACQUIRE);
+    n = MIN(count - sent, chan->size - (size_t) (tail - head));
+    if (n > 0) {
+      for (size_t i = 0; i < n; i++)
+        chan->ring[(tail + i) % chan->size] = items[sent + i];
+      tail += n;
+      sent += n;
+      __atomic_store_n(&chan->tail, tail, __ATOMIC_RELEASE);
+
+      /* Pairs with the receiver publishing itself, then rechecking. */
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      waiter_wake(&chan->receiver);
+      continue;
+    }
+
+    if (!chan_waits(state)) {
+      sched_errno(EAGAIN);
+      break;
+    }
+
+    __atomic_store_n(&chan->sender, state, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&chan->head, __ATOMIC_SEQ_CST) == head &&
+        !__atomic_load_n(&chan->closed, __ATOMIC_SEQ_CST))
+      sched_park(state);
+    waiter_leave(&chan->sender, state);
+  }
+
+  return sent;
+}
+
+static size_t
+spsc_recv(qlState *state, qlChannel *chan, qlParameter *items, size_t count)
+{
+  uint64_t tail, head = __atomic_load_n(&chan->head, __ATOMIC_RELAXED);
+  bool closed;
+  size_t n;
+
+  for (;;) {
+    closed = __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
+    tail = __atomic_load_n(&chan->tail, __ATOMIC_ACQUIRE);
+    n = MIN(count, (size_t) (tail - head));
+    if (n > 0) {
+      for (size_t i = 0; i < n; i++)
+        items[i] = chan->ring[(head + i) % chan->size];
+      __atomic_store_n(&chan->head, head + n, __ATOMIC_RELEASE);
+
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      waiter_wake(&chan->sender);
+      return n;
+    }
+
+    /* Everything sent before the close has been received. */
+    if (closed) {
+      sched_errno(EPIPE);
+      return 0;
+    }
+
+    if (!chan_waits(state)) {
+      sched_errno(EAGAIN);
+      return 0;
+    }
+
+    __atomic_store_n(&chan->receiver, state, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&chan->tail, __ATOMIC_SEQ_CST) == tail &&
+        !__atomic_load_n(&chan->closed, __ATOMIC_SEQ_CST))
+      sched_park(state);
+    waiter_leave(&chan->receiver, state);
+  }
+}
+
+size_t
+ql_chan_send_many(qlState *state, qlChannel *chan, const qlParameter *items,
+                  size_t count)
+{
+  chanWaiter *w, self = { .state = state };
+  size_t sent = 0, n;
+
+  if (chan->spsc)
+    return spsc_send(state, chan, items, count);
+
+  pthread_mutex_lock(&chan->lock);
+  while (sent < count) {
+    if (chan->closed) {
+      sched_errno(EPIPE);
+      break;
+    }
+
+    /* Receivers only wait on an empty ring: hand them the items. */
+    if ((w = queue_pop(&chan->receivers))) {
+      n = MIN(count - sent, w->count);
+      for (size_t i = 0; i < n; i++)
+        w->items[i] = items[sent + i];
+      w->count = n;
+      sent += n;
+      chan_wake(w);
+      continue;
+    }
+
+    n = MIN(count - sent, chan->size - (size_t) (chan->tail - chan->head));
+    if (n > 0) {
+      for (size_t i = 0; i < n; i++)
+        chan->ring[(chan->tail + i) % chan->size] = items[sent + i];
+      chan->tail += n;
+      sent += n;
+      continue;
+    }
+
+    if (!chan_waits(state)) {
+      sched_errno(EAGAIN);
+      break;
+    }
+
+    self.done = false;
+    chan_wait(chan, &chan->senders, &self);
+  }
+  pthread_mutex_unlock(&chan->lock);
+
+  return sent;
+}
+
+size_t
+ql_chan_recv_many(qlState *state, qlChannel *chan, qlParameter *items,
+                  size_t count)
+{
+  chanWaiter *w, self = { .state = state, .items = items, .count = count };
+  size_t n;
+
+  if (count == 0)
+    return 0;
+
+  if (chan->spsc)
+    return spsc_recv(state, chan, items, count);
+
+  pthread_mutex_lock(&chan->lock);
+  n = MIN(count, (size_t) (chan->tail - chan->head));
+  if (n > 0) {
+    for (size_t i = 0; i < n; i++)
+      items[i] = chan->ring[(chan->head + i) % chan->size];
+    chan->head += n;
+
+    /* Let as many senders try again as there are free slots. */
+    for (size_t i = 0; i < n && (w = queue_pop(&chan->senders)); i++)
+      chan_wake(w);
+  } else if (chan->closed) {
+    sched_errno(EPIPE);
+  } else if (!chan_waits(state)) {
+    sched_errno(EAGAIN);
+  } else {
+    /* An unbuffered channel only moves items to waiting receivers. */
+    if ((w = queue_pop(&chan->senders)))
+      chan_wake(w);
+    chan_wait(chan, &chan->receivers, &self);
+
+    /* Woken without items: closed. */
+    n = self.count;
+    if (n == 0)
+      sched_errno(EPIPE);
+  }
+  pthread_mutex_unlock(&chan->lock);
+
+  return n;
+}
+
+bool
+ql_chan_send(qlState *state, qlChannel *chan, qlParameter item)
+{
+  return ql_chan_send_many(state, chan, &item, 1) == 1;
+}
+
+bool
+ql_chan_recv(qlState *state, qlChannel *chan, qlParameter *item)
+{
+  return ql_chan_recv_many(state, chan, item, 1) == 1;
+}
+
+void
+ql_chan_close(qlChannel *chan)
+{
+  chanWaiter *w;
+
+  if (chan->spsc) {
+    __atomic_store_n(&chan->closed, true, __ATOMIC_SEQ_CST);
+    waiter_wake(&chan->sender);
+    waiter_wake(&chan->receiver);
+    return;
+  }
+
+  pthread_mutex_lock(&chan->lock);
+  chan->closed = true;
+  while ((w = queue_pop(&chan->senders)))
+    chan_wake(w);
+  while ((w = queue_pop(&chan->receivers))) {
+    w->count = 0;
+    chan_wake(w);
+  }
+  pthread_mutex_unlock(&chan->lock);
+}
@@ -0,0 +1,137 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <stdlib.h>
+
+/* Unlike the setjmp engine, a context here is nothing but a stack pointer.
+ * Only the callee-saved registers (and FPU control words) are stored, on
+ * the stack being switched away from; see libql-fcontext-x86_64.S. */
+typedef struct {
+  qlState state;
+  void   *stp;
+  void   *yld;
+  int     status;
+} qlStateFContext;
+
+void
+fcontext_swap(void **save, void *load);
+
+void
+fcontext_swap_nofpu(void **save, void *load);
+
+void *
+fcontext_make(void *top, void (*entry)(void *), void *arg);
+
+/* Both ends of a switch use the same flavour: the stepper's context is
+ * saved and loaded by the state's own switches. */
+static inline void
+swap(qlStateFContext *state, void **save, void *load)
+{
+  if (state->state.flags & QL_FLAG_NOFPU)
+    fcontext_swap_nofpu(save, load);
+  else
+    fcontext_swap(save, load);
+}
+
+static void
+inside_context(void *arg)
+{
+  qlStateFContext *state = arg;
+
+  state->state.param = state->state.func(&state->state, state->state.param);
+  state->status = STATUS_RETURN;
+  swap(state, &state->yld, state->stp);
+  abort(); /* Never get here */
+}
+
+size_t
+eng_fcontext_size()
+{
+  return sizeof(qlStateFContext);
+}
+
+size_t
+eng_fcontext_align()
+{
+  return 0x10;
+}
+
+size_t
+eng_fcontext_stack()
+{
+  return 0x04;
+}
+
+bool
+eng_fcontext_init(qlStateFContext *state)
+{
+  return true;
+}
+
+bool
+eng_fcontext_step(qlStateFContext *state)
+{
+  if (state->state.func)
+    state->yld = fcontext_make((char *) state->state.stack + state->state.size,
+                               inside_context, state);
+
+  swap(state, &state->stp, state->yld);
+  state->state.sp = state->yld;
+  return state->status == STATUS_YIELD;
+}
+
+void
+eng_fcontext_yield(qlStateFContext *state)
+{
+  state->status = STATUS_YIELD;
+  swap(state, &state->yld, state->stp);
+}
+
+/* Chains to onto from's stepper: to then swaps straight back to it. This
+ * only works if both save the stepper's context the same way. */
+bool
+eng_fcontext_transfer(qlStateFContext *from, qlStateFContext *to)
+{
+  if ((from->state.flags ^ to->state.flags) & QL_FLAG_NOFPU)
+    return false;
+
+  if (to->state.func)
+    to->yld = fcontext_make((char *) to->state.stack + to->state.size,
+                            inside_context, to);
+
+  to->stp = from->stp;
+  from->status = STATUS_YIELD;
+  swap(from, &from->yld, to->yld);
+  return true;
+}
+
+void
+eng_fcontext_unwind(qlStateFContext *state)
+{
+  state->status = STATUS_RETURN;
+  swap(state, &state->yld, state->stp);
+  abort(); /* Never get here */
+}
+
+void
+eng_fcontext_free(qlStateFContext *state)
+{
+}
@@ -20,26 +20,266 @@
 #ifndef LIBQL_INTERNAL_H_
 #define LIBQL_INTERNAL_H_
 
-#define STATUS_RETURN 1
-#define STATUS_YIELD  2
+#define STATUS_RETURN  1
+#define STATUS_YIELD   2
+#define STATUS_RUNNING 3
+
+/* The engine provides its own stacks; qlState.stack is left NULL. */
+#define ENGINE_OWNSTACK    0x01
+
+/* The engine supports QL_FLAG_SHAREDSTACK. When the engine switches away
+ * from a coroutine, it must store the lowest address of the coroutine's
+ * live frames in qlState.sp. */
+#define ENGINE_SHAREDSTACK 0x02
+
+/* The engine saves the FPU/SIMD control state on every switch, and can
+ * skip it for QL_FLAG_NOFPU. */
+#define ENGINE_NOFPU       0x04
+
+/* Values of qlState.task, for scheduled coroutines. A coroutine goes from
+ * RUNNING to PARKING before it yields to park, and its worker then moves
+ * it on to PARKED. A waker moves a PARKED coroutine back to RUNNING (and
+ * queues it), or any other one to NOTIFIED, so the next park returns at
+ * once. */
+#define TASK_RUNNING  0
+#define TASK_PARKING  1
+#define TASK_PARKED   2
+#define TASK_NOTIFIED 3
+
+/* Marks a waiter slot whose coroutine is being woken. */
+#define WAITER_WAKING ((qlState *) 1)
+
+/* The timer wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots; a slot at
+ * level n spans WHEEL_SLOTS^n milliseconds. */
+#define WHEEL_BITS   6
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 7
+
+/* The directions of an ioSlot. */
+#define IO_READ  0
+#define IO_WRITE 1
 
 #ifndef __ASSEMBLER__
 #include <libql.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <libsc.h>
 
 typedef struct qlStateEngine qlStateEngine;
+typedef struct stackRange stackRange;
+typedef struct sharedStack sharedStack;
+typedef struct ioReactor ioReactor;
+typedef struct wheelTimer wheelTimer;
+
+struct wheelTimer {
+  wheelTimer        *next;
+  wheelTimer       **pprev;   /* NULL unless in the wheel */
+  uint64_t           expires; /* In clock_msec() time */
+  unsigned int       level;
+  unsigned int       index;
+};
+
+typedef struct {
+  uint64_t           now;     /* Every timer up to this tick has fired */
+  uint64_t           bits[WHEEL_LEVELS]; /* Non-empty slots */
+  wheelTimer        *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} timerWheel;
+
+/* The state of one fd in the reactor. Each fd is registered with epoll
+ * once, edge triggered, for both directions. An edge sets ready and wakes
+ * the waiter (if any). A coroutine which saw EAGAIN publishes itself as the
+ * waiter and then checks ready; the event handler sets ready and then wakes
+ * the waiter. Either way, an edge between the EAGAIN and the park can't be
+ * lost. */
+typedef struct {
+  int                registered;
+  bool               ready[2];
+  qlState           *waiter[2];
+} ioSlot;
+
+/* A mapped stack (with its guard page), taken out of its state. */
+struct stackRange {
+  char              *start;
+  size_t             len;
+};
 
 struct qlState {
+  qlState            *next;   /* Link in the recycle pool or a run queue */
   const qlStateEngine *eng;
   qlFunction         *func;
   qlParameter        param;
   void              *stack;
+  size_t             size;
+  qlFlags            flags;
+  int                status;  /* 0 (never stepped) or STATUS_* */
+  void              *sp;      /* Lowest live stack address (suspended) */
+  sharedStack       *shared;
+  void              *copy;    /* Saved frames while evicted from shared */
+  size_t             copylen;
+  qlScheduler       *sched;   /* The scheduler running this state, if any */
+  int                cmd;     /* Why the state yielded to its scheduler */
+  int                task;    /* TASK_* (parking handshake with wakers) */
+  wheelTimer         timer;   /* Wakes the state from sched_park_until() */
+  uint64_t           deadline; /* For ql_io_*() waits, or 0 for none */
+  qlFunction         *origin; /* The function profiled, NULL if mixed */
+  void              *data;    /* See ql_state_new_data() */
+  size_t             datasize;
+  qlStats            stats;
+  uint64_t           yielded; /* When the state last yielded, for stats */
+  const qlAllocator  *alloc;  /* Where the state came from, NULL for libsc */
+  size_t             allocsize;
+  qlState            *root;   /* Transferred to: whose stepper to go back to */
+  qlState            *active; /* Being stepped: the state running instead */
+  qlState            *handoff; /* Being stepped: a transfer left to us */
+  qlCleanup          *cleanup; /* Handlers, innermost first */
+  bool               cancel;  /* Being cancelled: unwind once resumed */
+  bool               detached; /* Moving between threads (atomic) */
+  bool               ready;   /* Holds its stack and engine resources */
 };
 
+/* Whether runtime statistics are collected (see ql_stats_enable()). */
+extern bool stats_enabled;
+
+#define STATS_ENABLED() \
+  __builtin_expect(__atomic_load_n(&stats_enabled, __ATOMIC_RELAXED), 0)
+
 size_t
 get_pagesize();
 
+bool
+stack_alloc(qlState *state, size_t align);
+
+void
+stack_free(qlState *state);
+
+/* Takes a QL_FLAG_MMAPSTACK stack out of its state, for stack_unmap_many().
+ * Returns false (leaving the state alone) for any other stack. */
+bool
+stack_take(qlState *state, stackRange *range);
+
+/* Unmaps stacks taken by stack_take(), adjacent ones with a single call.
+ * This sorts the ranges. */
+void
+stack_unmap_many(stackRange *ranges, size_t count);
+
+/* Gives blocks back to the slab of alloc, taking each free list's lock
+ * once. Returns false (freeing nothing) if alloc isn't a slab's. */
+bool
+slab_free_many(const qlAllocator *alloc, void **blocks, size_t count);
+
+void *
+stack_mark() __attribute__ ((noinline));
+
+/* Records the stack usage of a painted state in its function's profile. */
+void
+stack_record(const qlState *state);
+
+bool
+shared_enter(qlState *state);
+
+void
+shared_leave(qlState *state, bool yielded);
+
+/* Suspends a scheduled coroutine until sched_wake() is called on it. This
+ * may return spuriously, so callers must recheck their condition. */
+void
+sched_park(qlState *state);
+
+/* Like sched_park(), but also returns once clock_msec() reaches deadline
+ * (0 for none). Returns false if the deadline has passed. */
+bool
+sched_park_until(qlState *state, uint64_t deadline);
+
+void
+sched_wake(qlState *state);
+
+/* A waiter slot holds (at most) one coroutine waiting for a waker. The
+ * coroutine publishes itself in the slot, rechecks its condition, parks
+ * (maybe more than once) and finally leaves the slot. Since a waker only
+ * touches the coroutine while the slot is WAITER_WAKING, the coroutine can
+ * go away as soon as waiter_leave() returns. */
+void
+waiter_wake(qlState **slot);
+
+void
+waiter_leave(qlState **slot, qlState *state);
+
+/* Sets errno in a coroutine which may have parked (and thus moved to
+ * another worker) since it last used errno. The compiler may cache errno's
+ * thread-local address, so this must not be inlined. */
+void
+sched_errno(int err) __attribute__ ((noinline));
+
+/* Takes a parked state away from its wakers, for freeing. Returns false if
+ * the state isn't parked. */
+bool
+sched_unpark(qlState *state);
+
+ioReactor *
+sched_reactor(qlScheduler *sched);
+
+ioReactor *
+reactor_new();
+
+void
+reactor_free(ioReactor *r);
+
+/* Waits for events (without handling them) and returns how many came. */
+int
+reactor_wait(ioReactor *r, int timeout);
+
+/* Wakes the coroutines waiting for the events of the last reactor_wait(). */
+void
+reactor_dispatch(ioReactor *r, int count);
+
+/* Interrupts a reactor_wait() in another thread. */
+void
+reactor_kick(ioReactor *r);
+
+/* Returns the slot through which a coroutine can wait on fd, or NULL if it
+ * has to block instead (e.g. for a regular file). The fd is registered and
+ * made non-blocking the first time it is seen. This may yield state. */
+ioSlot *
+reactor_register(ioReactor *r, qlState *state, int fd);
+
+/* Unregisters fd, before it is closed. */
+void
+reactor_forget(ioReactor *r, int fd);
+
+/* Starts the statistics of a step, returning its start time. */
+uint64_t
+stats_begin(qlState *state);
+
+void
+stats_end(qlState *state, uint64_t start);
+
+void
+stats_yield(qlState *state);
+
+/* The monotonic clock, in milliseconds. */
+uint64_t
+clock_msec();
+
+void
+wheel_init(timerWheel *w, uint64_t now);
+
+void
+wheel_add(timerWheel *w, wheelTimer *t, uint64_t expires);
+
+/* Removes a timer, if it is still in the wheel. */
+void
+wheel_del(timerWheel *w, wheelTimer *t);
+
+/* Returns the first tick at which the wheel has work (a lower bound of the
+ * next expiry), or UINT64_MAX if it is empty. */
+uint64_t
+wheel_next(timerWheel *w);
+
+/* Moves the wheel to now and returns the timers which expired, linked by
+ * their next field. */
+wheelTimer *
+wheel_advance(timerWheel *w, uint64_t now);
+
 #endif /* __ASSEMBLER__ */
 #endif /* LIBQL_INTERNAL_H_ */
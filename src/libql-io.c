@@ -0,0 +1,232 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* accept4() */
+
+#include "libql-internal.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* Returns the reactor slot of fd if the calling coroutine can wait on it
+ * through the reactor, or NULL (with errno 0) if we have to block. */
+static ioSlot *
+io_slot(qlState *state, int fd)
+{
+  ioSlot *slot = NULL;
+#ifdef WITH_EPOLL
+  ioReactor *r = state && state->sched ? sched_reactor(state->sched) : NULL;
+
+  if (r)
+    slot = reactor_register(r, state, fd);
+#endif
+
+  errno = 0;
+  return slot;
+}
+
+/* Blocks the thread until fd is ready or the state's deadline passes. */
+static bool
+io_poll(qlState *state, int fd, int dir)
+{
+  struct pollfd pfd = { fd, dir == IO_READ ? POLLIN : POLLOUT, 0 };
+  int timeout = -1, n;
+  uint64_t now;
+
+  if (state && state->deadline) {
+    now = clock_msec();
+    if (now >= state->deadline) {
+      errno = ETIMEDOUT;
+      return false;
+    }
+
+    timeout = state->deadline - now > INT_MAX
+            ? INT_MAX : (int) (state->deadline - now);
+  }
+
+  n = poll(&pfd, 1, timeout);
+  if (n == 0)
+    errno = ETIMEDOUT;
+  return n > 0 || (n < 0 && errno == EINTR);
+}
+
+/* Called after an operation on fd failed: decides whether to retry it and,
+ * if the fd wasn't ready, waits until it is (or until the deadline). This
+ * reads errno, so it must not be inlined into a loop which parks. */
+static bool __attribute__ ((noinline))
+io_retry(qlState *state, ioSlot *slot, int fd, int dir)
+{
+  bool woken;
+
+  if (errno == EINTR)
+    return true;
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINPROGRESS)
+    return false;
+
+  /* Not scheduled (or the fd wasn't ours to make non-blocking): block. */
+  if (!slot)
+    return io_poll(state, fd, dir);
+
+  __atomic_store_n(&slot->waiter[dir], state, __ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&slot->ready[dir], false, __ATOMIC_SEQ_CST)) {
+    /* An edge arrived in the meantime. */
+    waiter_leave(&slot->waiter[dir], state);
+    return true;
+  }
+
+  woken = sched_park_until(state, state->deadline);
+  waiter_leave(&slot->waiter[dir], state);
+  if (!woken) {
+    sched_errno(ETIMEDOUT);
+    return false;
+  }
+
+  return true;
+}
+
+ssize_t
+ql_io_read(qlState *state, int fd, void *buf, size_t len)
+{
+  ioSlot *slot = io_slot(state, fd);
+  ssize_t n;
+
+  while ((n = read(fd, buf, len)) < 0) {
+    if (!io_retry(state, slot, fd, IO_READ))
+      break;
+  }
+
+  return n;
+}
+
+ssize_t
+ql_io_write(qlState *state, int fd, const void *buf, size_t len)
+{
+  ioSlot *slot = io_slot(state, fd);
+  ssize_t n;
+
+  while ((n = write(fd, buf, len)) < 0) {
+    if (!io_retry(state, slot, fd, IO_WRITE))
+      break;
+  }
+
+  return n;
+}
+
+int
+ql_io_accept(qlState *state, int fd, struct sockaddr *addr, socklen_t *len)
+{
+  ioSlot *slot = io_slot(state, fd);
+  int sock;
+
+#ifdef WITH_EPOLL
+  while ((sock = accept4(fd, addr, len, slot ? SOCK_NONBLOCK : 0)) < 0) {
+#else
+  while ((sock = accept(fd, addr, len)) < 0) {
+#endif
+    if (!io_retry(state, slot, fd, IO_READ))
+      break;
+  }
+
+  return sock;
+}
+
+/* Checks on a connect() in progress: returns 1 once fd is connected, 0
+ * while it is still connecting and -1 (with errno) if it failed. A wakeup
+ * alone proves nothing: it may be spurious, and an unconnected socket is
+ * writable (with EPOLLHUP) as soon as it is registered. This reads errno,
+ * so it must not be inlined into a loop which parks. */
+static int __attribute__ ((noinline))
+io_connected(int fd)
+{
+  struct pollfd pfd = { fd, POLLOUT, 0 };
+  struct sockaddr_storage peer;
+  socklen_t len = sizeof(peer), errlen = sizeof(int);
+  int err;
+
+  if (poll(&pfd, 1, 0) < 0)
+    return errno == EINTR ? 0 : -1;
+  if (pfd.revents == 0)
+    return 0;
+
+  if (getpeername(fd, (struct sockaddr *) &peer, &len) == 0)
+    return 1;
+  if (errno != ENOTCONN)
+    return -1;
+
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0)
+    return -1;
+  if (err == 0)
+    return 0;
+
+  errno = err;
+  return -1;
+}
+
+int
+ql_io_connect(qlState *state, int fd, const struct sockaddr *addr,
+              socklen_t len)
+{
+  ioSlot *slot = io_slot(state, fd);
+  int rslt;
+
+  /* Only an edge after the connect() may tell us it completed. */
+  if (slot)
+    __atomic_store_n(&slot->ready[IO_WRITE], false, __ATOMIC_SEQ_CST);
+
+  if (connect(fd, addr, len) == 0)
+    return 0;
+
+  if (errno != EINPROGRESS && errno != EINTR)
+    return -1;
+
+  /* The connection completes when the socket becomes writable. */
+  errno = EINPROGRESS;
+  for (;;) {
+    if (!io_retry(state, slot, fd, IO_WRITE))
+      return -1;
+
+    rslt = io_connected(fd);
+    if (rslt != 0)
+      return rslt > 0 ? 0 : -1;
+
+    sched_errno(EINPROGRESS);
+  }
+}
+
+void
+ql_io_deadline(qlState *state, unsigned int msec)
+{
+  state->deadline = msec ? clock_msec() + msec : 0;
+}
+
+int
+ql_io_close(qlState *state, int fd)
+{
+#ifdef WITH_EPOLL
+  ioReactor *r = state && state->sched ? sched_reactor(state->sched) : NULL;
+
+  if (r)
+    reactor_forget(r, fd);
+#endif
+
+  return close(fd);
+}
@@ -21,44 +21,222 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include <pthread.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
-typedef struct qlStatePThread {
+/* How many idle threads we keep around for reuse. */
+#define POOL_MAX 64
+
+/* How many times we poll the turn before sleeping (multi-core only). */
+#define SPIN_MAX 1000
+
+/* Values of worker.turn. TURN_SLEEP is OR-ed in by a side which is
+ * sleeping on the turn, so the other side knows to wake it. */
+#define TURN_STEPPER 0x00
+#define TURN_WORKER  0x01
+#define TURN_SLEEP   0x02
+
+typedef struct qlStatePThread qlStatePThread;
+typedef struct worker worker;
+
+/* A thread which runs qlFunctions. Control is handed back and forth
+ * between the stepper and the worker through a single word: turn. When
+ * the qlState using the worker is freed, the worker is parked in the pool
+ * for use by a later qlState with the same stack size. */
+struct worker {
+  worker         *next;
+  size_t          size;
+  qlStatePThread *state;
+  int             turn;
+  sigjmp_buf      top;
+#ifndef __linux__
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+#endif
+};
+
+struct qlStatePThread {
   qlState state;
-  pthread_barrier_t barrier;
-  pthread_t thread;
-  bool returned;
-} qlStatePThread;
+  worker *worker;
+  bool    running;
+  bool    cancel;
+};
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static worker *pool = NULL;
+static size_t pool_count = 0;
+
+static inline void
+cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
 
 static void
-eng_pthread_free(qlStatePThread *state)
+turn_give(worker *w, int turn)
 {
-  pthread_cancel(state->thread);
-  pthread_join(state->thread, NULL);
-  pthread_barrier_destroy(&state->barrier);
+#ifdef __linux__
+  if (__atomic_exchange_n(&w->turn, turn, __ATOMIC_RELEASE) & TURN_SLEEP)
+    syscall(SYS_futex, &w->turn, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+  pthread_mutex_lock(&w->mutex);
+  w->turn = turn;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+#endif
 }
 
 static void
-barrier_wait(pthread_barrier_t *barrier)
+turn_wait(worker *w, int turn)
 {
-  int status;
-  status = pthread_barrier_wait(barrier);
-  assert(status == PTHREAD_BARRIER_SERIAL_THREAD || status == 0);
+#ifdef __linux__
+  static int spin = -1;
+  int other = turn ^ TURN_WORKER;
+  int cur;
+
+  if (spin < 0)
+    spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_MAX : 0;
+
+  for (int i = 0; i < spin; i++) {
+    if ((__atomic_load_n(&w->turn, __ATOMIC_ACQUIRE) & ~TURN_SLEEP) == turn)
+      return;
+    cpu_relax();
+  }
+
+  for (;;) {
+    cur = __atomic_load_n(&w->turn, __ATOMIC_ACQUIRE);
+    if ((cur & ~TURN_SLEEP) == turn)
+      return;
+
+    if (cur == other &&
+        !__atomic_compare_exchange_n(&w->turn, &cur, other | TURN_SLEEP,
+                                     false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_ACQUIRE))
+      continue;
+
+    syscall(SYS_futex, &w->turn, FUTEX_WAIT_PRIVATE,
+            other | TURN_SLEEP, NULL, NULL, 0);
+  }
+#else
+  pthread_mutex_lock(&w->mutex);
+  while (w->turn != turn)
+    pthread_cond_wait(&w->cond, &w->mutex);
+  pthread_mutex_unlock(&w->mutex);
+#endif
 }
 
 static void *
-inside_thread(qlStatePThread *state)
+inside_thread(worker *w)
+{
+  qlStatePThread *state;
+
+  for (;;) {
+    turn_wait(w, TURN_WORKER);
+
+    /* We were released from the pool. */
+    state = w->state;
+    if (!state)
+      break;
+
+    /* Cancellation jumps back here, abandoning the function's frames. */
+    if (sigsetjmp(w->top, 0) == 0) {
+      state->running = true;
+      state->state.param = state->state.func(&state->state,
+                                             state->state.param);
+    }
+    state->running = false;
+
+    turn_give(w, TURN_STEPPER);
+  }
+
+#ifndef __linux__
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->mutex);
+#endif
+  free(w);
+  return NULL;
+}
+
+static worker *
+worker_get(size_t size)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  worker **tmp;
+  worker *w = NULL;
+
+  pthread_mutex_lock(&pool_lock);
+  for (tmp = &pool; *tmp; tmp = &(*tmp)->next) {
+    if ((*tmp)->size == size) {
+      w = *tmp;
+      *tmp = w->next;
+      pool_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&pool_lock);
+  if (w)
+    return w;
+
+  w = calloc(1, sizeof(worker));
+  if (!w)
+    return NULL;
+  w->size = size;
+  w->turn = TURN_STEPPER;
+#ifndef __linux__
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+#endif
+
+  if (pthread_attr_init(&attr) != 0)
+    goto error;
+
+  if (pthread_attr_setstacksize(&attr, size) != 0 ||
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0 ||
+      pthread_create(&thread, &attr,
+                     (void*(*)(void*)) inside_thread, w) != 0) {
+    pthread_attr_destroy(&attr);
+    goto error;
+  }
+
+  pthread_attr_destroy(&attr);
+  return w;
+
+error:
+#ifndef __linux__
+  pthread_cond_destroy(&w->cond);
+  pthread_mutex_destroy(&w->mutex);
+#endif
+  free(w);
+  return NULL;
+}
+
+static void
+worker_put(worker *w)
 {
-  qlParameter param = NULL;
+  w->state = NULL;
 
-  barrier_wait(&state->barrier);
-  barrier_wait(&state->barrier);
+  pthread_mutex_lock(&pool_lock);
+  if (pool_count < POOL_MAX) {
+    w->next = pool;
+    pool = w;
+    pool_count++;
+    pthread_mutex_unlock(&pool_lock);
+    return;
+  }
+  pthread_mutex_unlock(&pool_lock);
 
-  state->state.param = state->state.func(&state->state, state->state.param);
-  state->returned = true;
-  barrier_wait(&state->barrier);
-  return param;
+  /* The pool is full; with no state, the thread exits. */
+  turn_give(w, TURN_WORKER);
 }
 
 size_t
@@ -82,48 +260,55 @@ eng_pthread_stack()
 bool
 eng_pthread_init(qlStatePThread *state)
 {
-  pthread_attr_t attr;
-
-  state->returned = false;
-  if (pthread_barrier_init(&state->barrier, NULL, 2) != 0)
+  state->worker = worker_get(state->state.size);
+  if (!state->worker)
     return false;
 
-  if (pthread_attr_init(&attr) != 0) {
-    pthread_barrier_destroy(&state->barrier);
-    return false;
-  }
-
-  if (pthread_attr_setstack(&attr, state->state.stack,
-                            sc_size(state->state.stack)) != 0) {
-    pthread_barrier_destroy(&state->barrier);
-    pthread_attr_destroy(&attr);
-    return false;
-  }
-
-  if (pthread_create(&state->thread, &attr,
-                     (void*(*)(void*)) inside_thread, state) != 0) {
-    pthread_barrier_destroy(&state->barrier);
-    pthread_attr_destroy(&attr);
-    return false;
-  }
-  pthread_attr_destroy(&attr);
-
-  barrier_wait(&state->barrier);
-  sc_destructor_set(state, eng_pthread_free);
+  state->worker->state = state;
   return true;
 }
 
 bool
 eng_pthread_step(qlStatePThread *state)
 {
-  barrier_wait(&state->barrier);
-  barrier_wait(&state->barrier);
-  return !state->returned;
+  turn_give(state->worker, TURN_WORKER);
+  turn_wait(state->worker, TURN_STEPPER);
+  return state->running;
 }
 
 void
 eng_pthread_yield(qlStatePThread *state)
 {
-  barrier_wait(&state->barrier);
-  barrier_wait(&state->barrier);
+  turn_give(state->worker, TURN_STEPPER);
+  turn_wait(state->worker, TURN_WORKER);
+
+  if (state->cancel)
+    siglongjmp(state->worker->top, 1); /* Never returns */
+}
+
+/* Each state runs on a thread of its own, so control always goes through
+ * the stepper. */
+bool
+eng_pthread_transfer(qlStatePThread *from, qlStatePThread *to)
+{
+  return false;
+}
+
+void
+eng_pthread_unwind(qlStatePThread *state)
+{
+  siglongjmp(state->worker->top, 1);
+}
+
+void
+eng_pthread_free(qlStatePThread *state)
+{
+  /* If the function is suspended, unwind it back to the top. */
+  if (state->running) {
+    state->cancel = true;
+    turn_give(state->worker, TURN_WORKER);
+    turn_wait(state->worker, TURN_STEPPER);
+  }
+
+  worker_put(state->worker);
 }
@@ -0,0 +1,254 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* The fd table is two-level, so slots never move once allocated. */
+#define CHUNK_SLOTS 1024
+#define CHUNKS      1024
+
+/* How many events we harvest per epoll_wait(). */
+#define EVENTS_MAX 64
+
+/* epoll_event.data of the kick eventfd. */
+#define KICK_EVENT UINT64_MAX
+
+/* Values of ioSlot.registered. */
+#define SLOT_NONE    0
+#define SLOT_BUSY    1 /* Being registered by another coroutine */
+#define SLOT_EPOLL   2
+#define SLOT_BLOCKS  3 /* Not pollable (e.g. a regular file) */
+
+struct ioReactor {
+  int                epfd;
+  int                kickfd;
+  bool               kicked;
+  ioSlot            *chunks[CHUNKS];
+  struct epoll_event events[EVENTS_MAX];
+};
+
+ioReactor *
+reactor_new()
+{
+  struct epoll_event ev = { .events = EPOLLIN, .data.u64 = KICK_EVENT };
+  ioReactor *r;
+
+  r = calloc(1, sizeof(ioReactor));
+  if (!r)
+    return NULL;
+
+  r->epfd = epoll_create1(EPOLL_CLOEXEC);
+  r->kickfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (r->epfd < 0 || r->kickfd < 0 ||
+      epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->kickfd, &ev) != 0) {
+    reactor_free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void
+reactor_free(ioReactor *r)
+{
+  if (!r)
+    return;
+
+  /* Free the coroutines still waiting for I/O (unless the scheduler has
+   * already taken them, for their timers). */
+  for (size_t i = 0; i < CHUNKS; i++) {
+    if (!r->chunks[i])
+      continue;
+
+    for (size_t j = 0; j < CHUNK_SLOTS; j++) {
+      for (int dir = IO_READ; dir <= IO_WRITE; dir++) {
+        qlState *waiter = r->chunks[i][j].waiter[dir];
+        if (waiter && sched_unpark(waiter))
+          ql_state_free(waiter);
+      }
+    }
+
+    free(r->chunks[i]);
+  }
+
+  if (r->kickfd >= 0)
+    close(r->kickfd);
+  if (r->epfd >= 0)
+    close(r->epfd);
+  free(r);
+}
+
+static ioSlot *
+reactor_slot(ioReactor *r, int fd)
+{
+  ioSlot *chunk, *old = NULL;
+
+  if (fd < 0 || fd >= CHUNKS * CHUNK_SLOTS) {
+    errno = EBADF;
+    return NULL;
+  }
+
+  chunk = __atomic_load_n(&r->chunks[fd / CHUNK_SLOTS], __ATOMIC_ACQUIRE);
+  if (chunk)
+    return &chunk[fd % CHUNK_SLOTS];
+
+  chunk = calloc(CHUNK_SLOTS, sizeof(ioSlot));
+  if (!chunk)
+    return NULL;
+
+  if (!__atomic_compare_exchange_n(&r->chunks[fd / CHUNK_SLOTS], &old, chunk,
+                                   false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(chunk);
+    chunk = old;
+  }
+
+  return &chunk[fd % CHUNK_SLOTS];
+}
+
+static void
+reactor_ready(ioSlot *slot, int dir)
+{
+  __atomic_store_n(&slot->ready[dir], true, __ATOMIC_SEQ_CST);
+  waiter_wake(&slot->waiter[dir]);
+}
+
+int
+reactor_wait(ioReactor *r, int timeout)
+{
+  int n;
+
+  /* Kicks from here on write to the eventfd again, and the write stays
+   * readable until a dispatch drains it, so none can be missed. */
+  if (timeout != 0)
+    __atomic_store_n(&r->kicked, false, __ATOMIC_SEQ_CST);
+
+  do {
+    n = epoll_wait(r->epfd, r->events, EVENTS_MAX, timeout);
+  } while (n < 0 && errno == EINTR && timeout < 0);
+
+  return n < 0 ? 0 : n;
+}
+
+void
+reactor_dispatch(ioReactor *r, int count)
+{
+  for (int i = 0; i < count; i++) {
+    struct epoll_event *ev = &r->events[i];
+    ioSlot *slot;
+
+    if (ev->data.u64 == KICK_EVENT) {
+      uint64_t val;
+      if (read(r->kickfd, &val, sizeof(val)) < 0) {
+        /* Already drained. */
+      }
+      continue;
+    }
+
+    slot = reactor_slot(r, (int) ev->data.u64);
+    if (!slot)
+      continue;
+
+    if (ev->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+      reactor_ready(slot, IO_READ);
+    if (ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+      reactor_ready(slot, IO_WRITE);
+  }
+}
+
+void
+reactor_kick(ioReactor *r)
+{
+  uint64_t one = 1;
+
+  if (__atomic_exchange_n(&r->kicked, true, __ATOMIC_ACQ_REL))
+    return;
+
+  if (write(r->kickfd, &one, sizeof(one)) < 0) {
+    /* The counter is already non-zero. */
+  }
+}
+
+ioSlot *
+reactor_register(ioReactor *r, qlState *state, int fd)
+{
+  struct epoll_event ev = {
+    .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+    .data.u64 = (uint64_t) fd
+  };
+  ioSlot *slot;
+  int flags, reg;
+
+  slot = reactor_slot(r, fd);
+  if (!slot)
+    return NULL;
+
+  for (;;) {
+    reg = SLOT_NONE;
+    if (__atomic_compare_exchange_n(&slot->registered, &reg, SLOT_BUSY,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      break;
+
+    if (reg == SLOT_EPOLL)
+      return slot;
+    if (reg == SLOT_BLOCKS)
+      return NULL;
+
+    ql_sched_yield(state);
+  }
+
+  reg = SLOT_EPOLL;
+  if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 && errno != EEXIST)
+    reg = SLOT_BLOCKS;
+  else {
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 ||
+        (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+      reg = SLOT_BLOCKS;
+  }
+
+  __atomic_store_n(&slot->registered, reg, __ATOMIC_RELEASE);
+  return reg == SLOT_EPOLL ? slot : NULL;
+}
+
+void
+reactor_forget(ioReactor *r, int fd)
+{
+  ioSlot *slot;
+
+  if (fd < 0 || fd >= CHUNKS * CHUNK_SLOTS ||
+      !__atomic_load_n(&r->chunks[fd / CHUNK_SLOTS], __ATOMIC_ACQUIRE))
+    return;
+
+  slot = reactor_slot(r, fd);
+  if (__atomic_load_n(&slot->registered, __ATOMIC_ACQUIRE) == SLOT_EPOLL)
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+  slot->ready[IO_READ] = slot->ready[IO_WRITE] = false;
+  __atomic_store_n(&slot->registered, SLOT_NONE, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,896 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+
+#include "libql-internal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+/* Initial capacity of a worker's deque (grows as needed). */
+#define DEQUE_SIZE 256
+
+/* Every FAIR_TICKS scheduling decisions, a worker looks at the shared and
+ * yield queues before its own deque, so they can't be starved. */
+#define FAIR_TICKS 61
+
+/* How many rounds of stealing an idle worker tries before it sleeps. */
+#define STEAL_ROUNDS 4
+
+/* Reasons for a coroutine to switch back to its worker (qlState.cmd). */
+#define CMD_YIELD 0
+#define CMD_EXIT  1
+#define CMD_PARK  2
+
+typedef struct dequeArray dequeArray;
+typedef struct worker worker;
+
+/* A Chase-Lev work-stealing deque (see "Correct and Efficient Work-Stealing
+ * for Weak Memory Models", Lê et al., PPoPP 2013). The owning worker pushes
+ * and takes at the bottom, other workers steal from the top. Arrays which
+ * were outgrown can still be read by a thief, so they are only freed along
+ * with the scheduler. */
+struct dequeArray {
+  dequeArray *prev;
+  int64_t     size;
+  qlState    *buf[];
+};
+
+typedef struct {
+  int64_t     top;
+  int64_t     bottom;
+  dequeArray *array;
+} deque;
+
+struct worker {
+  qlScheduler *sched;
+  pthread_t    thread;
+  bool         started;
+  deque        deque;
+  qlState     *yhead;  /* Coroutines which yielded (FIFO) */
+  qlState     *ytail;
+  unsigned int tick;
+  unsigned int seed;   /* For choosing victims to steal from */
+  size_t       index;
+};
+
+struct qlScheduler {
+  worker         *workers;
+  size_t          count;
+  bool            stop;
+
+  pthread_mutex_t lock;    /* Protects the inject queue and sleeping */
+  pthread_cond_t  wake;    /* Signaled when there is work (or stop) */
+  pthread_cond_t  done;    /* Signaled when live drops to zero */
+  qlState        *ihead;   /* Coroutines spawned from outside (FIFO) */
+  qlState        *itail;
+  size_t          sleepers;
+  size_t          live;
+
+  ioReactor      *reactor; /* NULL without epoll */
+  worker         *poller;  /* The worker harvesting the reactor, if any */
+
+  pthread_mutex_t tlock;   /* Protects the timer wheel */
+  timerWheel      wheel;
+  uint64_t        tnext;   /* No timer expires before this */
+};
+
+static __thread worker *current = NULL;
+
+static dequeArray *
+deque_array(int64_t size)
+{
+  dequeArray *a;
+
+  a = calloc(1, sizeof(dequeArray) + size * sizeof(qlState *));
+  if (a)
+    a->size = size;
+  return a;
+}
+
+static bool
+deque_push(deque *d, qlState *state)
+{
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  dequeArray *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+
+  if (b - t > a->size - 1) {
+    dequeArray *n = deque_array(a->size * 2);
+    if (!n)
+      return false;
+
+    for (int64_t i = t; i < b; i++)
+      n->buf[i % n->size] = a->buf[i % a->size];
+    n->prev = a;
+    __atomic_store_n(&d->array, n, __ATOMIC_RELEASE);
+    a = n;
+  }
+
+  __atomic_store_n(&a->buf[b % a->size], state, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+static qlState *
+deque_take(deque *d)
+{
+  int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+  dequeArray *a = __atomic_load_n(&d->array, __ATOMIC_RELAXED);
+  qlState *state = NULL;
+  int64_t t;
+
+  __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+  if (t <= b) {
+    state = __atomic_load_n(&a->buf[b % a->size], __ATOMIC_RELAXED);
+    if (t == b) {
+      /* The last one: race thieves for it. */
+      if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        state = NULL;
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+  } else
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+
+  return state;
+}
+
+static qlState *
+deque_steal(deque *d)
+{
+  int64_t t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+  dequeArray *a;
+  qlState *state;
+  int64_t b;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b)
+    return NULL;
+
+  a = __atomic_load_n(&d->array, __ATOMIC_ACQUIRE);
+  state = __atomic_load_n(&a->buf[t % a->size], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+
+  return state;
+}
+
+static bool
+deque_empty(deque *d)
+{
+  return __atomic_load_n(&d->top, __ATOMIC_ACQUIRE) >=
+         __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+}
+
+/* Wakes a sleeping worker, if there is one. The seq_cst fence pairs with
+ * the one in worker_sleep(): either we see the sleeper, or it sees the
+ * work we just queued. */
+static void
+sched_notify(qlScheduler *sched)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&sched->sleepers, __ATOMIC_RELAXED) == 0)
+    return;
+
+#ifdef WITH_EPOLL
+  {
+    worker *poller = __atomic_load_n(&sched->poller, __ATOMIC_RELAXED);
+    if (poller && poller != current)
+      reactor_kick(sched->reactor);
+  }
+#endif
+
+  pthread_mutex_lock(&sched->lock);
+  pthread_cond_signal(&sched->wake);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static void
+sched_inject(qlScheduler *sched, qlState *state)
+{
+  pthread_mutex_lock(&sched->lock);
+  state->next = NULL;
+  if (sched->itail)
+    sched->itail->next = state;
+  else
+    __atomic_store_n(&sched->ihead, state, __ATOMIC_RELAXED);
+  sched->itail = state;
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static qlState *
+sched_uninject(qlScheduler *sched)
+{
+  qlState *state;
+
+  if (!__atomic_load_n(&sched->ihead, __ATOMIC_RELAXED))
+    return NULL;
+
+  pthread_mutex_lock(&sched->lock);
+  state = sched->ihead;
+  if (state) {
+    __atomic_store_n(&sched->ihead, state->next, __ATOMIC_RELAXED);
+    if (!sched->ihead)
+      sched->itail = NULL;
+    state->next = NULL;
+  }
+  pthread_mutex_unlock(&sched->lock);
+  return state;
+}
+
+/* Queues a runnable coroutine: on the current worker's deque if we are on
+ * a worker of this scheduler, otherwise on the shared inject queue. */
+static void
+sched_enqueue(qlScheduler *sched, qlState *state)
+{
+  if (!current || current->sched != sched ||
+      !deque_push(&current->deque, state))
+    sched_inject(sched, state);
+
+  sched_notify(sched);
+}
+
+static void
+sched_release(qlScheduler *sched)
+{
+  if (__atomic_sub_fetch(&sched->live, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+
+  pthread_mutex_lock(&sched->lock);
+  pthread_cond_broadcast(&sched->done);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static qlState *
+worker_yielded(worker *w)
+{
+  qlState *state = w->yhead;
+
+  if (state) {
+    w->yhead = state->next;
+    if (!w->yhead)
+      w->ytail = NULL;
+    state->next = NULL;
+  }
+
+  return state;
+}
+
+static qlState *
+worker_steal(worker *w)
+{
+  qlScheduler *sched = w->sched;
+  qlState *state;
+  size_t i, start;
+
+  if (sched->count < 2)
+    return NULL;
+
+  for (int round = 0; round < STEAL_ROUNDS; round++) {
+    start = rand_r(&w->seed) % sched->count;
+    for (i = 0; i < sched->count; i++) {
+      worker *victim = &sched->workers[(start + i) % sched->count];
+      if (victim == w)
+        continue;
+
+      state = deque_steal(&victim->deque);
+      if (state)
+        return state;
+    }
+  }
+
+  return NULL;
+}
+
+/* Wakes the coroutines whose timers expired. The wakes happen under the
+ * wheel's lock, so a coroutine disarming its timer can't go away while it
+ * is still being woken. */
+static void
+sched_timers(qlScheduler *sched)
+{
+  wheelTimer *expired, *t;
+  uint64_t now;
+
+  if (__atomic_load_n(&sched->tnext, __ATOMIC_RELAXED) == UINT64_MAX)
+    return;
+
+  now = clock_msec();
+  if (now < __atomic_load_n(&sched->tnext, __ATOMIC_RELAXED) ||
+      pthread_mutex_trylock(&sched->tlock) != 0)
+    return;
+
+  expired = wheel_advance(&sched->wheel, now);
+  __atomic_store_n(&sched->tnext, wheel_next(&sched->wheel),
+                   __ATOMIC_SEQ_CST);
+
+  while ((t = expired)) {
+    expired = t->next;
+    t->next = NULL;
+    sched_wake((qlState *) ((char *) t - offsetof(qlState, timer)));
+  }
+
+  pthread_mutex_unlock(&sched->tlock);
+}
+
+/* Returns how long an idle worker may sleep before a timer expires, in
+ * milliseconds, or -1 if there is no timer. */
+static int
+sched_timeout(qlScheduler *sched)
+{
+  uint64_t next = __atomic_load_n(&sched->tnext, __ATOMIC_SEQ_CST);
+  uint64_t now;
+
+  if (next == UINT64_MAX)
+    return -1;
+
+  now = clock_msec();
+  if (next <= now)
+    return 0;
+  return next - now > INT_MAX ? INT_MAX : (int) (next - now);
+}
+
+static bool
+worker_has_work(qlScheduler *sched)
+{
+  if (sched->ihead)
+    return true;
+
+  for (size_t i = 0; i < sched->count; i++) {
+    if (!deque_empty(&sched->workers[i].deque))
+      return true;
+  }
+
+  return false;
+}
+
+#ifdef WITH_EPOLL
+/* Harvests I/O events, if no other worker is doing so. If the worker is
+ * idle, it blocks until an event arrives or it is kicked. The woken
+ * coroutines are queued on this worker, for the others to steal. The
+ * events are dispatched before the reactor is handed back, since the next
+ * poller reuses their buffer. */
+static void
+worker_poll(worker *w, bool idle)
+{
+  qlScheduler *sched = w->sched;
+  worker *none = NULL;
+  int count;
+
+  if (!__atomic_compare_exchange_n(&sched->poller, &none, w, false,
+                                   __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+
+  if (idle) {
+    __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+    count = 0;
+    if (!__atomic_load_n(&sched->stop, __ATOMIC_ACQUIRE) &&
+        !worker_has_work(sched))
+      count = reactor_wait(sched->reactor, sched_timeout(sched));
+    __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+  } else
+    count = reactor_wait(sched->reactor, 0);
+
+  reactor_dispatch(sched->reactor, count);
+  __atomic_store_n(&sched->poller, NULL, __ATOMIC_RELEASE);
+}
+#endif
+
+static qlState *
+worker_next(worker *w)
+{
+  qlState *state;
+
+  if (++w->tick % FAIR_TICKS == 0) {
+#ifdef WITH_EPOLL
+    worker_poll(w, false);
+#endif
+    sched_timers(w->sched);
+    if ((state = sched_uninject(w->sched)))
+      return state;
+    if ((state = worker_yielded(w)))
+      return state;
+  }
+
+  if ((state = deque_take(&w->deque)))
+    return state;
+  if ((state = worker_yielded(w)))
+    return state;
+  if ((state = sched_uninject(w->sched)))
+    return state;
+  return worker_steal(w);
+}
+
+static void
+worker_sleep(worker *w)
+{
+  qlScheduler *sched = w->sched;
+  struct timespec ts;
+  struct timeval tv;
+  int timeout;
+
+  sched_timers(sched);
+
+#ifdef WITH_EPOLL
+  /* One idle worker sleeps in the reactor, the others here. */
+  if (!__atomic_load_n(&sched->poller, __ATOMIC_RELAXED)) {
+    worker_poll(w, true);
+    return;
+  }
+#endif
+
+  pthread_mutex_lock(&sched->lock);
+  __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+  if (!sched->stop && !worker_has_work(sched)) {
+    timeout = sched_timeout(sched);
+    if (timeout < 0)
+      pthread_cond_wait(&sched->wake, &sched->lock);
+    else if (timeout > 0) {
+      gettimeofday(&tv, NULL);
+      ts.tv_sec = tv.tv_sec + timeout / 1000;
+      ts.tv_nsec = tv.tv_usec * 1000 + timeout % 1000 * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+    }
+  }
+  __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&sched->lock);
+}
+
+static void
+worker_run(worker *w, qlState *state)
+{
+  qlParameter param = state->param;
+  int expect;
+
+  state->cmd = CMD_YIELD;
+  if (!ql_state_step(state, &param)) {
+    ql_state_recycle(NULL, state);
+    sched_release(w->sched);
+    return;
+  }
+
+  switch (state->cmd) {
+  case CMD_EXIT:
+    ql_state_free(state);
+    sched_release(w->sched);
+    break;
+
+  case CMD_PARK:
+    expect = TASK_PARKING;
+    if (__atomic_compare_exchange_n(&state->task, &expect, TASK_PARKED,
+                                    false, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE))
+      break; /* The waker owns it now. */
+
+    /* Woken before it even parked. */
+    __atomic_store_n(&state->task, TASK_RUNNING, __ATOMIC_RELAXED);
+    /* Fall through */
+
+  default:
+    state->param = NULL;
+    state->next = NULL;
+    if (w->ytail)
+      w->ytail->next = state;
+    else
+      w->yhead = state;
+    w->ytail = state;
+
+    /* Let idle workers take it from our deque. */
+    if (__atomic_load_n(&w->sched->sleepers, __ATOMIC_RELAXED) > 0 &&
+        deque_empty(&w->deque) && (state = worker_yielded(w))) {
+      if (!deque_push(&w->deque, state))
+        sched_inject(w->sched, state);
+      sched_notify(w->sched);
+    }
+    break;
+  }
+}
+
+static void *
+worker_main(worker *w)
+{
+  qlState *state;
+
+  current = w;
+  while (!__atomic_load_n(&w->sched->stop, __ATOMIC_ACQUIRE)) {
+    state = worker_next(w);
+    if (state)
+      worker_run(w, state);
+    else
+      worker_sleep(w);
+  }
+
+  current = NULL;
+  ql_state_pool_clear();
+  return NULL;
+}
+
+static void
+sched_free(void *mem)
+{
+  qlScheduler *sched = mem;
+  qlState *state, *parked = NULL;
+  wheelTimer *t;
+  size_t i;
+
+  pthread_mutex_lock(&sched->lock);
+  __atomic_store_n(&sched->stop, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&sched->wake);
+  pthread_mutex_unlock(&sched->lock);
+#ifdef WITH_EPOLL
+  if (sched->reactor)
+    reactor_kick(sched->reactor);
+#endif
+
+  for (i = 0; i < sched->count; i++) {
+    if (sched->workers[i].started)
+      pthread_join(sched->workers[i].thread, NULL);
+  }
+
+  /* Free all the coroutines which never finished. The sleeping ones are
+   * only held by the wheel, but those waiting for I/O with a deadline are
+   * in the reactor too: take them all out first, and free them last. */
+  t = wheel_advance(&sched->wheel, UINT64_MAX);
+  for (; t; t = t->next) {
+    state = (qlState *) ((char *) t - offsetof(qlState, timer));
+    if (sched_unpark(state)) {
+      state->next = parked;
+      parked = state;
+    }
+  }
+
+  for (i = 0; i < sched->count; i++) {
+    worker *w = &sched->workers[i];
+    dequeArray *a, *prev;
+
+    while ((state = deque_take(&w->deque)) || (state = worker_yielded(w)))
+      ql_state_free(state);
+
+    for (a = w->deque.array; a; a = prev) {
+      prev = a->prev;
+      free(a);
+    }
+  }
+  while ((state = sched_uninject(sched)))
+    ql_state_free(state);
+#ifdef WITH_EPOLL
+  reactor_free(sched->reactor);
+#endif
+  while ((state = parked)) {
+    parked = state->next;
+    ql_state_free(state);
+  }
+
+  pthread_cond_destroy(&sched->done);
+  pthread_cond_destroy(&sched->wake);
+  pthread_mutex_destroy(&sched->tlock);
+  pthread_mutex_destroy(&sched->lock);
+}
+
+qlScheduler *
+ql_sched_new(void *parent, size_t workers)
+{
+  qlScheduler *sched;
+  bool pin = false;
+  size_t i;
+#ifdef __linux__
+  cpu_set_t allowed;
+  int cpu = -1;
+#endif
+
+  if (workers == 0) {
+#ifdef __linux__
+    /* One worker for each CPU we may run on, pinned to it. */
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+        CPU_COUNT(&allowed) > 0) {
+      workers = CPU_COUNT(&allowed);
+      pin = true;
+    }
+#endif
+    if (workers == 0) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      workers = cpus > 0 ? cpus : 1;
+    }
+  }
+
+  sched = sc_malloc0(parent, sizeof(qlScheduler), "qlScheduler");
+  if (!sched)
+    return NULL;
+
+  sched->workers = sc_malloc0(sched, sizeof(worker) * workers, "workers");
+  if (!sched->workers) {
+    sc_decref(parent, sched);
+    return NULL;
+  }
+
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->wake, NULL);
+  pthread_cond_init(&sched->done, NULL);
+  pthread_mutex_init(&sched->tlock, NULL);
+  wheel_init(&sched->wheel, clock_msec());
+  sched->tnext = UINT64_MAX;
+  sc_destructor_set(sched, sched_free);
+
+#ifdef WITH_EPOLL
+  sched->reactor = reactor_new();
+  if (!sched->reactor) {
+    sc_decref(parent, sched);
+    return NULL;
+  }
+#endif
+
+  for (i = 0; i < workers; i++) {
+    worker *w = &sched->workers[i];
+
+    w->sched = sched;
+    w->index = i;
+    w->seed = (unsigned int) (i + 1);
+    w->deque.array = deque_array(DEQUE_SIZE);
+    if (!w->deque.array) {
+      sc_decref(parent, sched);
+      return NULL;
+    }
+  }
+
+  /* Only start threads once every worker is ready to be stolen from. */
+  sched->count = workers;
+  for (i = 0; i < workers; i++) {
+    worker *w = &sched->workers[i];
+
+    if (pthread_create(&w->thread, NULL,
+                       (void*(*)(void*)) worker_main, w) != 0) {
+      sc_decref(parent, sched);
+      return NULL;
+    }
+    w->started = true;
+
+#ifdef __linux__
+    if (pin) {
+      cpu_set_t set;
+
+      /* Worker i goes to the i-th allowed CPU. */
+      while (!CPU_ISSET(++cpu, &allowed))
+        continue;
+
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      if (pthread_setaffinity_np(w->thread, sizeof(set), &set) != 0) {
+        sc_decref(parent, sched);
+        return NULL;
+      }
+    }
+#endif
+  }
+
+  return sched;
+}
+
+bool
+ql_sched_spawn(qlScheduler *sched, const char *eng, qlFunction *func,
+               size_t pages, qlParameter param)
+{
+  qlState *state;
+
+  if (!sched)
+    return false;
+
+  state = ql_state_new(NULL, eng, func, pages);
+  if (!state)
+    return false;
+
+  state->sched = sched;
+  state->param = param;
+  state->task = TASK_RUNNING;
+  state->deadline = 0;
+  __atomic_add_fetch(&sched->live, 1, __ATOMIC_ACQ_REL);
+  sched_enqueue(sched, state);
+  return true;
+}
+
+void
+ql_sched_yield(qlState *state)
+{
+  assert(state && state->sched);
+
+  state->cmd = CMD_YIELD;
+  ql_state_yield(state, NULL);
+}
+
+void
+ql_sched_exit(qlState *state)
+{
+  assert(state && state->sched);
+
+  state->cmd = CMD_EXIT;
+  ql_state_yield(state, NULL);
+  abort(); /* Never get here */
+}
+
+void
+sched_park(qlState *state)
+{
+  int expect = TASK_RUNNING;
+
+  assert(state && state->sched);
+
+  if (!__atomic_compare_exchange_n(&state->task, &expect, TASK_PARKING,
+                                   false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE)) {
+    /* Consume the pending notification. */
+    __atomic_store_n(&state->task, TASK_RUNNING, __ATOMIC_RELAXED);
+    return;
+  }
+
+  state->cmd = CMD_PARK;
+  ql_state_yield(state, NULL);
+}
+
+bool
+sched_park_until(qlState *state, uint64_t deadline)
+{
+  qlScheduler *sched = state->sched;
+  bool sooner, fired;
+
+  if (deadline == 0) {
+    sched_park(state);
+    return true;
+  }
+
+  if (clock_msec() >= deadline)
+    return false;
+
+  pthread_mutex_lock(&sched->tlock);
+  wheel_add(&sched->wheel, &state->timer, deadline);
+  sooner = deadline < __atomic_load_n(&sched->tnext, __ATOMIC_RELAXED);
+  if (sooner)
+    __atomic_store_n(&sched->tnext, deadline, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&sched->tlock);
+
+  /* An idle worker may be sleeping past the new deadline. */
+  if (sooner)
+    sched_notify(sched);
+
+  sched_park(state);
+
+  pthread_mutex_lock(&sched->tlock);
+  fired = !state->timer.pprev;
+  wheel_del(&sched->wheel, &state->timer);
+  pthread_mutex_unlock(&sched->tlock);
+  return !fired;
+}
+
+void
+sched_errno(int err)
+{
+  errno = err;
+}
+
+void
+waiter_wake(qlState **slot)
+{
+  qlState *state = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+  if (!state || state == WAITER_WAKING ||
+      !__atomic_compare_exchange_n(slot, &state, WAITER_WAKING, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+
+  sched_wake(state);
+  __atomic_store_n(slot, NULL, __ATOMIC_RELEASE);
+}
+
+void
+waiter_leave(qlState **slot, qlState *state)
+{
+  qlState *expect = state;
+
+  if (__atomic_compare_exchange_n(slot, &expect, NULL, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return;
+
+  /* Taken by a waker: wait until it is done with us. */
+  while (__atomic_load_n(slot, __ATOMIC_ACQUIRE) == WAITER_WAKING)
+    sched_yield();
+}
+
+bool
+sched_unpark(qlState *state)
+{
+  int task = TASK_PARKED;
+
+  return __atomic_compare_exchange_n(&state->task, &task, TASK_RUNNING,
+                                     false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE);
+}
+
+void
+sched_wake(qlState *state)
+{
+  int task = __atomic_load_n(&state->task, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    if (task == TASK_NOTIFIED)
+      return;
+
+    if (task == TASK_PARKED) {
+      if (sched_unpark(state)) {
+        sched_enqueue(state->sched, state);
+        return;
+      }
+      task = __atomic_load_n(&state->task, __ATOMIC_ACQUIRE);
+    } else if (__atomic_compare_exchange_n(&state->task, &task,
+                                           TASK_NOTIFIED, false,
+                                           __ATOMIC_ACQ_REL,
+                                           __ATOMIC_ACQUIRE))
+      return;
+  }
+}
+
+void
+ql_sched_sleep(qlState *state, unsigned int msec)
+{
+  uint64_t deadline;
+
+  assert(state && state->sched);
+
+  if (msec == 0) {
+    ql_sched_yield(state);
+    return;
+  }
+
+  deadline = clock_msec() + msec;
+  while (sched_park_until(state, deadline))
+    continue;
+}
+
+ioReactor *
+sched_reactor(qlScheduler *sched)
+{
+  return sched->reactor;
+}
+
+void
+ql_sched_wait(qlScheduler *sched)
+{
+  pthread_mutex_lock(&sched->lock);
+  while (__atomic_load_n(&sched->live, __ATOMIC_ACQUIRE) > 0)
+    pthread_cond_wait(&sched->done, &sched->lock);
+  pthread_mutex_unlock(&sched->lock);
+}
@@ -91,7 +91,7 @@ eng_setjmp_step(qlStateSetJmp *state)
     dolongjmp(state->yield, 1); /* Never returns */
 
   call_function(state, &state->state.param, state->state.func,
-                state->state.stack, sc_size(state->state.stack), state->step);
+                state->state.stack, state->state.size, state->step);
   /* Never returns */
 }
 
@@ -99,6 +99,36 @@ void
 eng_setjmp_yield(qlStateSetJmp *state)
 {
   /* Store our state */
+  state->state.sp = stack_mark();
   if (setjmp(state->yield) == 0)
     dolongjmp(state->step, STATUS_YIELD); /* Never returns */
 }
+
+/* Chains to onto from's stepper: to then jumps straight back to it. */
+bool
+eng_setjmp_transfer(qlStateSetJmp *from, qlStateSetJmp *to)
+{
+  memcpy(to->step, from->step, sizeof(jmp_buf));
+
+  from->state.sp = stack_mark();
+  if (setjmp(from->yield) != 0)
+    return true;
+
+  if (!to->state.func)
+    dolongjmp(to->yield, 1); /* Never returns */
+
+  call_function(to, &to->state.param, to->state.func,
+                to->state.stack, to->state.size, to->step);
+  /* Never returns */
+}
+
+void
+eng_setjmp_unwind(qlStateSetJmp *state)
+{
+  dolongjmp(state->step, STATUS_RETURN);
+}
+
+void
+eng_setjmp_free(qlStateSetJmp *state)
+{
+}
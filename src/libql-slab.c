@@ -0,0 +1,341 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <string.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SLAB_CHUNKS 1
+#endif
+
+/* Transparent huge pages are 2MiB on the platforms which have them. */
+#define SLAB_HUGEPAGE (2 * 1024 * 1024)
+
+/* Free lists, one per NUMA node; nodes beyond these share them. */
+#define SLAB_NODES 64
+
+/* How many allocations a thread makes before it checks its node again. */
+#define SLAB_NODE_CHECK 256
+
+/* MPOL_PREFERRED, from <linux/mempolicy.h> (which we don't want). */
+#define SLAB_MPOL_PREFERRED 1
+
+typedef struct slabBlock slabBlock;
+typedef struct slabChunk slabChunk;
+
+/* A free block, linked through its first word. */
+struct slabBlock {
+  slabBlock *next;
+};
+
+/* The first page of a chunk mapped by the slab itself. Such chunks are
+ * aligned to their size, so a block finds its chunk (and node) by masking
+ * its address. */
+struct slabChunk {
+  slabChunk   *next;
+  unsigned int node;
+};
+
+/* A free list, guarded by a spinlock: it is only ever held for a few
+ * instructions (or while a chunk is allocated). Each has a cache line of
+ * its own, so that the nodes don't contend. */
+typedef struct {
+  bool       lock;
+  slabBlock *free;
+} __attribute__ ((aligned(64))) slabList;
+
+/* Without flags, blocks are carved out of chunks of count blocks, which
+ * are libsc children of the slab, and there is a single free list. With
+ * flags, chunks are mapped with mmap() and span bytes long. */
+struct qlSlab {
+  qlAllocator allocator;
+  size_t      size;
+  size_t      count;
+  qlFlags     flags;
+  size_t      span;
+  slabChunk  *chunks;
+  slabList    lists[SLAB_NODES];
+};
+
+static __thread unsigned int node_cached;
+static __thread unsigned int node_uses;
+
+static void
+slab_lock(slabList *list)
+{
+  while (__atomic_test_and_set(&list->lock, __ATOMIC_ACQUIRE))
+    continue;
+}
+
+static void
+slab_unlock(slabList *list)
+{
+  __atomic_clear(&list->lock, __ATOMIC_RELEASE);
+}
+
+/* The NUMA node of the calling thread's CPU, checked now and then. */
+static unsigned int
+slab_node()
+{
+#ifdef SYS_getcpu
+  if (node_uses++ % SLAB_NODE_CHECK == 0) {
+    unsigned int cpu, node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+      node_cached = node;
+  }
+#endif
+
+  return node_cached;
+}
+
+#ifdef SLAB_CHUNKS
+/* Maps a chunk of span bytes aligned to span, for node. */
+static slabChunk *
+slab_map(qlSlab *slab, unsigned int node)
+{
+  size_t span = slab->span;
+  char *mem, *chunk;
+
+  mem = mmap(NULL, span * 2, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+
+  /* Trim the mapping down to the aligned chunk. */
+  chunk = (char *) (((uintptr_t) mem + span - 1) & ~(uintptr_t) (span - 1));
+  if (chunk > mem)
+    munmap(mem, chunk - mem);
+  munmap(chunk + span, mem + span - chunk);
+
+  /* Both are hints: the chunk works without them. */
+#ifdef MADV_HUGEPAGE
+  if (slab->flags & QL_SLAB_HUGEPAGES)
+    madvise(chunk, span, MADV_HUGEPAGE);
+#endif
+#ifdef SYS_mbind
+  if ((slab->flags & QL_SLAB_NUMA) && node < sizeof(unsigned long) * 8) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, chunk, span, SLAB_MPOL_PREFERRED, &mask,
+            sizeof(mask) * 8, 0);
+  }
+#endif
+
+  return (slabChunk *) chunk;
+}
+
+static void
+slab_unmap(void *mem)
+{
+  qlSlab *slab = mem;
+  slabChunk *chunk;
+
+  while ((chunk = slab->chunks)) {
+    slab->chunks = chunk->next;
+    munmap(chunk, slab->span);
+  }
+}
+#endif
+
+/* Adds a chunk of blocks to a free list, which is locked and empty. */
+static bool
+slab_grow(qlSlab *slab, slabList *list, unsigned int node)
+{
+  size_t count = slab->count;
+  char *blocks;
+
+#ifdef SLAB_CHUNKS
+  if (slab->flags) {
+    slabChunk *chunk = slab_map(slab, node);
+    if (!chunk)
+      return false;
+
+    chunk->node = node;
+    chunk->next = __atomic_load_n(&slab->chunks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&slab->chunks, &chunk->next, chunk,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+      continue;
+
+    blocks = (char *) chunk + get_pagesize();
+    count = (slab->span - get_pagesize()) / slab->size;
+  } else
+#endif
+  {
+    blocks = sc_memalign(slab, get_pagesize(), slab->size * count,
+                         "qlSlabChunk");
+    if (!blocks)
+      return false;
+  }
+
+  for (size_t i = count; i-- > 0;) {
+    slabBlock *block = (slabBlock *) (blocks + i * slab->size);
+    block->next = list->free;
+    list->free = block;
+  }
+
+  return true;
+}
+
+/* The free list of a block: that of the node its chunk was placed on. */
+static slabList *
+slab_list(qlSlab *slab, void *mem)
+{
+#ifdef SLAB_CHUNKS
+  if (slab->flags & QL_SLAB_NUMA) {
+    uintptr_t chunk = (uintptr_t) mem & ~(uintptr_t) (slab->span - 1);
+    return &slab->lists[((slabChunk *) chunk)->node % SLAB_NODES];
+  }
+#endif
+
+  return &slab->lists[0];
+}
+
+static void *
+slab_alloc(void *ctx, size_t size, size_t align)
+{
+  qlSlab *slab = ctx;
+  slabBlock *block = NULL;
+  unsigned int node = 0;
+  slabList *list;
+
+  if (size > slab->size || align > get_pagesize())
+    return NULL;
+
+  if (slab->flags & QL_SLAB_NUMA)
+    node = slab_node();
+  list = &slab->lists[node % SLAB_NODES];
+
+  slab_lock(list);
+  if (list->free || slab_grow(slab, list, node)) {
+    block = list->free;
+    list->free = block->next;
+  }
+  slab_unlock(list);
+
+  return block;
+}
+
+static void
+slab_free(void *ctx, void *mem, size_t size)
+{
+  qlSlab *slab = ctx;
+  slabList *list = slab_list(slab, mem);
+  slabBlock *block = mem;
+
+  slab_lock(list);
+  block->next = list->free;
+  list->free = block;
+  slab_unlock(list);
+}
+
+bool
+slab_free_many(const qlAllocator *alloc, void **blocks, size_t count)
+{
+  slabBlock *heads[SLAB_NODES] = { NULL }, *tails[SLAB_NODES];
+  qlSlab *slab;
+  size_t i;
+
+  if (alloc->free != slab_free)
+    return false;
+  slab = alloc->ctx;
+
+  /* Chain the blocks of each free list, then splice each chain in. */
+  for (i = 0; i < count; i++) {
+    size_t n = slab_list(slab, blocks[i]) - slab->lists;
+    slabBlock *block = blocks[i];
+
+    block->next = heads[n];
+    if (!heads[n])
+      tails[n] = block;
+    heads[n] = block;
+  }
+
+  for (i = 0; i < SLAB_NODES; i++) {
+    if (!heads[i])
+      continue;
+
+    slab_lock(&slab->lists[i]);
+    tails[i]->next = slab->lists[i].free;
+    slab->lists[i].free = heads[i];
+    slab_unlock(&slab->lists[i]);
+  }
+
+  return true;
+}
+
+qlSlab *
+ql_slab_new(void *parent, size_t size, size_t count)
+{
+  return ql_slab_new_flags(parent, size, count, QL_SLAB_NONE);
+}
+
+qlSlab *
+ql_slab_new_flags(void *parent, size_t size, size_t count, qlFlags flags)
+{
+  size_t pagesize = get_pagesize();
+  qlSlab *slab;
+
+  if (size == 0 || count == 0)
+    return NULL;
+
+#ifndef SLAB_CHUNKS
+  flags = QL_SLAB_NONE;
+#endif
+
+  slab = sc_memalign(parent, sizeof(slabList), sizeof(qlSlab), "qlSlab");
+  if (!slab)
+    return NULL;
+  memset(slab, 0, sizeof(qlSlab));
+
+  /* Page aligned blocks keep the stacks in them page aligned. */
+  slab->size = (size + pagesize - 1) & ~(pagesize - 1);
+  slab->count = count;
+  slab->flags = flags;
+  slab->allocator.alloc = slab_alloc;
+  slab->allocator.free = slab_free;
+  slab->allocator.ctx = slab;
+
+#ifdef SLAB_CHUNKS
+  /* A chunk holds its header page and at least count blocks, rounded up
+   * to a power of two (and to a huge page). */
+  if (flags) {
+    size_t need = pagesize + slab->size * count;
+
+    slab->span = flags & QL_SLAB_HUGEPAGES ? SLAB_HUGEPAGE : pagesize;
+    while (slab->span < need)
+      slab->span *= 2;
+
+    sc_destructor_set(slab, slab_unmap);
+  }
+#endif
+
+  return slab;
+}
+
+const qlAllocator *
+ql_slab_allocator(qlSlab *slab)
+{
+  return slab ? &slab->allocator : NULL;
+}
@@ -0,0 +1,417 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+#ifndef MAP_STACK
+#define MAP_STACK 0
+#endif
+
+/* The pattern painted on stacks with QL_FLAG_STACKPAINT. */
+#define PAINT_BYTE 0xA5
+#define PAINT_WORD ((uintptr_t) 0xA5A5A5A5A5A5A5A5ULL)
+
+/* The number of qlFunctions (a power of two) which can have a profile. */
+#define PROFILE_SLOTS 1024
+
+/* The deepest stack usage recorded for a qlFunction. Slots are claimed
+ * (and never released) with a compare-and-swap of func, so the table needs
+ * no lock. */
+typedef struct {
+  qlFunction *func;
+  size_t      used;
+} stackProfile;
+
+static stackProfile profiles[PROFILE_SLOTS];
+
+/* Maps a stack with a guard page below it. The stack itself is mapped
+ * without reserving swap, so pages are only committed when touched. */
+static void *
+stack_map(size_t size)
+{
+  size_t guard = get_pagesize();
+  char *mem;
+
+#ifdef _WIN32
+  DWORD old;
+
+  mem = VirtualAlloc(NULL, size + guard, MEM_RESERVE | MEM_COMMIT,
+                     PAGE_READWRITE);
+  if (!mem)
+    return NULL;
+
+  if (!VirtualProtect(mem, guard, PAGE_NOACCESS, &old)) {
+    VirtualFree(mem, 0, MEM_RELEASE);
+    return NULL;
+  }
+#else
+  mem = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+
+  if (mprotect(mem, guard, PROT_NONE) != 0) {
+    munmap(mem, size + guard);
+    return NULL;
+  }
+#endif
+
+  return mem + guard;
+}
+
+static void
+stack_unmap(void *stack, size_t size)
+{
+  size_t guard = get_pagesize();
+
+#ifdef _WIN32
+  VirtualFree((char *) stack - guard, 0, MEM_RELEASE);
+#else
+  munmap((char *) stack - guard, size + guard);
+#endif
+}
+
+#ifndef _WIN32
+static int
+range_compare(const void *a, const void *b)
+{
+  const stackRange *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+#endif
+
+/* A stack on which many qlStates (with QL_FLAG_SHAREDSTACK) run, one at a
+ * time. The owner is the state whose frames are currently on the stack.
+ * When a different state needs the stack, the owner's live frames (from
+ * its saved stack pointer up to the top) are copied out to its own buffer;
+ * they are copied back when the owner runs again. Shared stacks belong to
+ * the thread which created them. */
+struct sharedStack {
+  sharedStack *next;
+  char        *mem;
+  size_t       size;
+  size_t       users;
+  qlState     *owner;
+};
+
+static __thread sharedStack *shared = NULL;
+
+void *
+stack_mark()
+{
+  return __builtin_frame_address(0);
+}
+
+static bool
+shared_contains(sharedStack *ss, void *addr)
+{
+  return (char *) addr >= ss->mem && (char *) addr < ss->mem + ss->size;
+}
+
+/* Binds the state to a shared stack of its size. We can't use a stack we
+ * are currently running on (we'd overwrite our own frames), which happens
+ * when a shared-stack coroutine steps another one. */
+static bool
+shared_bind(qlState *state)
+{
+  void *sp = stack_mark();
+  sharedStack *ss;
+
+  for (ss = shared; ss; ss = ss->next) {
+    if (ss->size == state->size && !shared_contains(ss, sp))
+      break;
+  }
+
+  if (!ss) {
+    ss = calloc(1, sizeof(sharedStack));
+    if (!ss)
+      return false;
+
+    ss->mem = stack_map(state->size);
+    if (!ss->mem) {
+      free(ss);
+      return false;
+    }
+
+    ss->size = state->size;
+    ss->next = shared;
+    shared = ss;
+  }
+
+  ss->users++;
+  state->shared = ss;
+  state->stack = ss->mem;
+  return true;
+}
+
+static void
+shared_unbind(qlState *state)
+{
+  sharedStack *ss = state->shared;
+  sharedStack **tmp;
+
+  if (ss->owner == state)
+    ss->owner = NULL;
+
+  free(state->copy);
+  state->copy = NULL;
+  state->copylen = 0;
+  state->shared = NULL;
+  state->stack = NULL;
+
+  if (--ss->users > 0)
+    return;
+
+  for (tmp = &shared; *tmp; tmp = &(*tmp)->next) {
+    if (*tmp == ss) {
+      *tmp = ss->next;
+      break;
+    }
+  }
+
+  stack_unmap(ss->mem, ss->size);
+  free(ss);
+}
+
+bool
+shared_enter(qlState *state)
+{
+  sharedStack *ss;
+  qlState *owner;
+  size_t len;
+  void *copy;
+
+  if (!state->shared && !shared_bind(state))
+    return false;
+
+  ss = state->shared;
+  assert(!shared_contains(ss, stack_mark()));
+  if (ss->owner == state)
+    return true;
+
+  /* Evict the current owner. */
+  owner = ss->owner;
+  if (owner) {
+    len = ss->mem + ss->size - (char *) owner->sp;
+    copy = realloc(owner->copy, len);
+    if (!copy)
+      return false;
+
+    memcpy(copy, owner->sp, len);
+    owner->copy = copy;
+    owner->copylen = len;
+    ss->owner = NULL;
+  }
+
+  /* Restore our frames, if we have any. */
+  if (state->copylen > 0)
+    memcpy(ss->mem + ss->size - state->copylen,
+           state->copy, state->copylen);
+
+  ss->owner = state;
+  return true;
+}
+
+void
+shared_leave(qlState *state, bool yielded)
+{
+  /* Nothing on the stack is worth keeping once the function returns. */
+  if (!yielded) {
+    state->shared->owner = NULL;
+    state->copylen = 0;
+  }
+}
+
+/* Finds a function's profile, claiming a slot for it if add is set. */
+static stackProfile *
+profile_find(qlFunction *func, bool add)
+{
+  size_t hash = ((uintptr_t) func >> 4) * 0x9E3779B1;
+
+  for (size_t i = 0; i < PROFILE_SLOTS; i++) {
+    stackProfile *p = &profiles[(hash + i) & (PROFILE_SLOTS - 1)];
+    qlFunction *f = __atomic_load_n(&p->func, __ATOMIC_ACQUIRE);
+
+    if (!f) {
+      if (!add)
+        return NULL;
+
+      if (!__atomic_compare_exchange_n(&p->func, &f, func, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        if (f != func)
+          continue;
+      return p;
+    }
+
+    if (f == func)
+      return p;
+  }
+
+  return NULL;
+}
+
+static size_t
+stack_used(const qlState *state)
+{
+  const uintptr_t *word = state->stack;
+  const uintptr_t *end = (void *) ((char *) state->stack + state->size);
+
+  if (!(state->flags & QL_FLAG_STACKPAINT) || !state->stack)
+    return 0;
+
+  /* Stacks grow down: the untouched paint is at the bottom. */
+  while (word < end && *word == PAINT_WORD)
+    word++;
+
+  return (char *) end - (char *) word;
+}
+
+void
+stack_record(const qlState *state)
+{
+  size_t used = stack_used(state), old;
+  stackProfile *p;
+
+  if (!used || !state->origin)
+    return;
+
+  p = profile_find(state->origin, true);
+  if (!p)
+    return;
+
+  old = __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+  while (old < used &&
+         !__atomic_compare_exchange_n(&p->used, &old, used, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    continue;
+}
+
+size_t
+ql_state_stack_used(const qlState *state)
+{
+  return state ? stack_used(state) : 0;
+}
+
+size_t
+ql_stack_advise(qlFunction *func)
+{
+  size_t pagesize = get_pagesize(), used;
+  stackProfile *p;
+
+  p = profile_find(func, false);
+  if (!p)
+    return 0;
+
+  used = __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+  if (!used)
+    return 0;
+
+  return (used + used / 2 + pagesize - 1) / pagesize;
+}
+
+bool
+stack_alloc(qlState *state, size_t align)
+{
+  /* Shared stacks are bound on the first step. */
+  if (state->flags & QL_FLAG_SHAREDSTACK)
+    return true;
+
+  /* A state from an allocator comes with its stack. */
+  if (state->flags & QL_FLAG_MMAPSTACK)
+    state->stack = stack_map(state->size);
+  else if (!state->alloc)
+    state->stack = sc_memalign(state, align, state->size, "qlStack");
+
+  if (state->stack && (state->flags & QL_FLAG_STACKPAINT))
+    memset(state->stack, PAINT_BYTE, state->size);
+
+  return state->stack != NULL;
+}
+
+bool
+stack_take(qlState *state, stackRange *range)
+{
+  size_t guard = get_pagesize();
+
+  if (!state->stack || !(state->flags & QL_FLAG_MMAPSTACK) ||
+      (state->flags & QL_FLAG_SHAREDSTACK))
+    return false;
+
+  range->start = (char *) state->stack - guard;
+  range->len = state->size + guard;
+  state->stack = NULL;
+  return true;
+}
+
+void
+stack_unmap_many(stackRange *ranges, size_t count)
+{
+  size_t i, j;
+
+#ifdef _WIN32
+  /* Each mapping must be released on its own. */
+  for (i = 0; i < count; i++)
+    VirtualFree(ranges[i].start, 0, MEM_RELEASE);
+#else
+  /* Mappings made one after another tend to be adjacent. */
+  qsort(ranges, count, sizeof(stackRange), range_compare);
+  for (i = 0; i < count; i = j) {
+    size_t len = ranges[i].len;
+
+    for (j = i + 1; j < count && ranges[j].start == ranges[i].start + len; j++)
+      len += ranges[j].len;
+
+    munmap(ranges[i].start, len);
+  }
+#endif
+}
+
+void
+stack_free(qlState *state)
+{
+  if (!state->stack)
+    return;
+
+  if (state->flags & QL_FLAG_SHAREDSTACK)
+    shared_unbind(state);
+  else if (state->flags & QL_FLAG_MMAPSTACK)
+    stack_unmap(state->stack, state->size);
+  else if (!state->alloc)
+    sc_decref(state, state->stack);
+  else
+    return; /* Part of the state's block */
+
+  state->stack = NULL;
+}
@@ -0,0 +1,100 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <time.h>
+
+bool stats_enabled;
+
+/* The process-wide totals. Each field is updated atomically on its own. */
+static qlStats total;
+
+static uint64_t
+clock_nsec()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+total_add(unsigned long long *field, uint64_t value)
+{
+  __atomic_fetch_add(field, value, __ATOMIC_RELAXED);
+}
+
+uint64_t
+stats_begin(qlState *state)
+{
+  uint64_t now = clock_nsec();
+
+  if (state->yielded) {
+    state->stats.suspended += now - state->yielded;
+    total_add(&total.suspended, now - state->yielded);
+  }
+
+  state->stats.steps++;
+  state->stats.resumed = now;
+  total_add(&total.steps, 1);
+  __atomic_store_n(&total.resumed, now, __ATOMIC_RELAXED);
+  return now;
+}
+
+void
+stats_end(qlState *state, uint64_t start)
+{
+  uint64_t now = clock_nsec();
+
+  state->stats.running += now - start;
+  total_add(&total.running, now - start);
+  state->yielded = state->status == STATUS_YIELD ? now : 0;
+}
+
+void
+stats_yield(qlState *state)
+{
+  state->stats.yields++;
+  total_add(&total.yields, 1);
+}
+
+bool
+ql_stats_enable(bool enable)
+{
+  return __atomic_exchange_n(&stats_enabled, enable, __ATOMIC_RELAXED);
+}
+
+void
+ql_state_stats(const qlState *state, qlStats *stats)
+{
+  *stats = state->stats;
+  if (state->status == STATUS_YIELD && state->yielded)
+    stats->suspended += clock_nsec() - state->yielded;
+}
+
+void
+ql_stats_total(qlStats *stats)
+{
+  stats->steps = __atomic_load_n(&total.steps, __ATOMIC_RELAXED);
+  stats->yields = __atomic_load_n(&total.yields, __ATOMIC_RELAXED);
+  stats->running = __atomic_load_n(&total.running, __ATOMIC_RELAXED);
+  stats->suspended = __atomic_load_n(&total.suspended, __ATOMIC_RELAXED);
+  stats->resumed = __atomic_load_n(&total.resumed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,189 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libql-internal.h"
+
+#include <string.h>
+#include <time.h>
+
+/* The ticks covered by the wheel: about 139 years of clock_msec(), which
+ * starts near boot. Later timers are parked at the end of the top level and
+ * placed again when they cascade. */
+#define WHEEL_SPAN (((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+/* The index of a tick's slot at a level. */
+#define WHEEL_INDEX(tick, level) \
+  ((unsigned int) ((tick) >> ((level) * WHEEL_BITS)) & WHEEL_MASK)
+
+uint64_t
+clock_msec()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void
+wheel_init(timerWheel *w, uint64_t now)
+{
+  memset(w, 0, sizeof(*w));
+  w->now = now;
+}
+
+/* A timer goes to the level of the highest group of bits in which its
+ * expiry differs from now. Everything above that level is shared with
+ * now, so the slot cascades down (or fires, at level 0) exactly when now
+ * reaches it, and never wraps around. */
+static void
+wheel_place(timerWheel *w, wheelTimer *t)
+{
+  uint64_t expires = t->expires;
+  unsigned int level = 0;
+  wheelTimer **slot;
+
+  if (expires <= w->now)
+    expires = w->now + 1;
+  else if ((expires ^ w->now) > WHEEL_SPAN)
+    expires = w->now | WHEEL_SPAN;
+
+  if ((expires ^ w->now) > WHEEL_MASK)
+    level = (63 - __builtin_clzll(expires ^ w->now)) / WHEEL_BITS;
+
+  t->level = level;
+  t->index = WHEEL_INDEX(expires, level);
+
+  slot = &w->slots[t->level][t->index];
+  t->next = *slot;
+  if (t->next)
+    t->next->pprev = &t->next;
+  t->pprev = slot;
+  *slot = t;
+  w->bits[t->level] |= (uint64_t) 1 << t->index;
+}
+
+void
+wheel_add(timerWheel *w, wheelTimer *t, uint64_t expires)
+{
+  t->expires = expires;
+  wheel_place(w, t);
+}
+
+void
+wheel_del(timerWheel *w, wheelTimer *t)
+{
+  if (!t->pprev)
+    return;
+
+  *t->pprev = t->next;
+  if (t->next)
+    t->next->pprev = t->pprev;
+  if (!w->slots[t->level][t->index])
+    w->bits[t->level] &= ~((uint64_t) 1 << t->index);
+
+  t->next = NULL;
+  t->pprev = NULL;
+}
+
+uint64_t
+wheel_next(timerWheel *w)
+{
+  uint64_t next = UINT64_MAX;
+
+  for (unsigned int level = 0; level < WHEEL_LEVELS; level++) {
+    unsigned int shift = level * WHEEL_BITS;
+    unsigned int index = WHEEL_INDEX(w->now, level);
+    uint64_t later, tick;
+
+    /* Slots at or before now's are empty: they have already fired or
+     * cascaded. */
+    later = index == WHEEL_MASK ? 0 : w->bits[level] >> (index + 1);
+    if (!later)
+      continue;
+
+    index += 1 + __builtin_ctzll(later);
+    tick = (w->now >> shift >> WHEEL_BITS << WHEEL_BITS | index) << shift;
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+/* Removes a slot's list from the wheel. The timers' links are left stale,
+ * for the caller to fix up. */
+static wheelTimer *
+wheel_take(timerWheel *w, unsigned int level, unsigned int index)
+{
+  wheelTimer *list = w->slots[level][index];
+
+  w->slots[level][index] = NULL;
+  w->bits[level] &= ~((uint64_t) 1 << index);
+  return list;
+}
+
+wheelTimer *
+wheel_advance(timerWheel *w, uint64_t now)
+{
+  wheelTimer *expired = NULL, *list, *t;
+  uint64_t tick;
+
+  /* Jump from one occupied slot to the next, so an idle stretch costs
+   * nothing however long it was. */
+  while (w->now < now) {
+    tick = wheel_next(w);
+    if (tick > now) {
+      w->now = now;
+      break;
+    }
+    w->now = tick;
+
+    /* Cascade the slots this tick starts, from the top down. */
+    for (unsigned int level = WHEEL_LEVELS - 1; level > 0; level--) {
+      if (tick & ((((uint64_t) 1) << (level * WHEEL_BITS)) - 1))
+        continue;
+
+      list = wheel_take(w, level, WHEEL_INDEX(tick, level));
+      while ((t = list)) {
+        list = t->next;
+        if (t->expires > tick) {
+          wheel_place(w, t);
+          continue;
+        }
+
+        t->pprev = NULL;
+        t->next = expired;
+        expired = t;
+      }
+    }
+
+    /* Fire this tick's slot. */
+    list = wheel_take(w, 0, WHEEL_INDEX(tick, 0));
+    while ((t = list)) {
+      list = t->next;
+      t->pprev = NULL;
+      t->next = expired;
+      expired = t;
+    }
+  }
+
+  return expired;
+}
@@ -17,16 +17,32 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* With QL_FLAG_NOSIGMASK we siglongjmp() between stacks, which glibc's
+ * fortified longjmp would (wrongly) report as stack corruption. */
+#ifdef _FORTIFY_SOURCE
+#undef _FORTIFY_SOURCE
+#endif
+
 #include "libql-internal.h"
 #include <assert.h>
+#include <setjmp.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ucontext.h>
 
+/* With QL_FLAG_NOSIGMASK, the ucontext functions are only used once, in
+ * eng_ucontext_init(), to enter the new stack. From then on every switch
+ * is a sigsetjmp()/siglongjmp() pair which doesn't touch the signal mask,
+ * so no system calls are made. The context loops forever, so it can be
+ * reused for as many calls of the qlFunction as the qlState sees. */
 typedef struct qlStateUContext {
   qlState      state;
   volatile int jumped;
   ucontext_t   stpctx;
   ucontext_t   yldctx;
+  sigjmp_buf   stpbuf;
+  sigjmp_buf   yldbuf;
+  sigjmp_buf   topbuf;
 } qlStateUContext;
 
 /* This should work even on a 128bit system. */
@@ -55,12 +71,6 @@ eng_ucontext_stack()
   return 0x04;
 }
 
-bool
-eng_ucontext_init(qlStateUContext *state)
-{
-  return sizeof(void*) <= sizeof(pointerPasser);
-}
-
 static void
 inside_context(int a, int b, int c, int d)
 {
@@ -70,9 +80,73 @@ inside_context(int a, int b, int c, int d)
   pp.state->jumped = STATUS_RETURN;
 }
 
+static void
+inside_loop(int a, int b, int c, int d)
+{
+  pointerPasser pp = { .num = { a, b, c, d } };
+  qlStateUContext *state = pp.state;
+
+  /* Cancellation jumps back here, abandoning the function's frames. */
+  sigsetjmp(state->topbuf, 0);
+
+  for (;;) {
+    if (sigsetjmp(state->yldbuf, 0) == 0)
+      siglongjmp(state->stpbuf, STATUS_RETURN); /* Never returns */
+
+    state->state.param = state->state.func(&state->state,
+                                           state->state.param);
+  }
+}
+
+static bool
+make_context(qlStateUContext *state, ucontext_t *link, void (*func)(void))
+{
+  pointerPasser pp = { .num = { 0, 0, 0, 0 } };
+  pp.state = state;
+
+  if (getcontext(&state->yldctx) != 0)
+    return false;
+  state->yldctx.uc_link = link;
+  state->yldctx.uc_stack.ss_size = state->state.size;
+  state->yldctx.uc_stack.ss_sp = state->state.stack;
+
+  /* Encode the pointer into the args buffer. */
+  makecontext(&state->yldctx, func,
+              4, pp.num.a, pp.num.b, pp.num.c, pp.num.d);
+  return true;
+}
+
+bool
+eng_ucontext_init(qlStateUContext *state)
+{
+  if (sizeof(void*) > sizeof(pointerPasser))
+    return false;
+
+  /* Run the new context up to the top of its loop. */
+  if (state->state.flags & QL_FLAG_NOSIGMASK) {
+    if (!make_context(state, NULL, (void (*)(void)) inside_loop))
+      return false;
+
+    if (sigsetjmp(state->stpbuf, 0) == 0) {
+      if (swapcontext(&state->stpctx, &state->yldctx) != 0)
+        return false;
+    }
+  }
+
+  return true;
+}
+
 bool
 eng_ucontext_step(qlStateUContext *state)
 {
+  if (state->state.flags & QL_FLAG_NOSIGMASK) {
+    int status = sigsetjmp(state->stpbuf, 0);
+    if (status != 0)
+      return status == STATUS_YIELD;
+
+    siglongjmp(state->yldbuf, 1); /* Never returns */
+  }
+
   state->jumped = 0;
   assert(getcontext(&state->stpctx) == 0);
 
@@ -80,17 +154,9 @@ eng_ucontext_step(qlStateUContext *state)
     return state->jumped == STATUS_YIELD;
 
   if (state->state.func) {
-    pointerPasser pp;
-    pp.state = state;
-
-    assert(getcontext(&state->yldctx) == 0);
-    state->yldctx.uc_link = &state->stpctx;
-    state->yldctx.uc_stack.ss_size = sc_size(state->state.stack);
-    state->yldctx.uc_stack.ss_sp = state->state.stack;
-
-    /* Encode the pointer into the args buffer and execute. */
-    makecontext(&state->yldctx, (void (*)(void)) inside_context,
-                4, pp.num.a, pp.num.b, pp.num.c, pp.num.d);
+    if (!make_context(state, &state->stpctx,
+                      (void (*)(void)) inside_context))
+      return false;
   } else
     state->jumped = -1; /* Resume */
 
@@ -101,6 +167,12 @@ eng_ucontext_step(qlStateUContext *state)
 void
 eng_ucontext_yield(qlStateUContext *state)
 {
+  if (state->state.flags & QL_FLAG_NOSIGMASK) {
+    if (sigsetjmp(state->yldbuf, 0) == 0)
+      siglongjmp(state->stpbuf, STATUS_YIELD); /* Never returns */
+    return;
+  }
+
   state->jumped = 0;
   assert(getcontext(&state->yldctx) == 0);
 
@@ -110,8 +182,33 @@ eng_ucontext_yield(qlStateUContext *state)
   }
 }
 
+/* Chains to onto from's stepper, which only works between the jumps of
+ * QL_FLAG_NOSIGMASK: a ucontext_t can't be copied. */
+bool
+eng_ucontext_transfer(qlStateUContext *from, qlStateUContext *to)
+{
+  if (!(from->state.flags & to->state.flags & QL_FLAG_NOSIGMASK))
+    return false;
+
+  memcpy(to->stpbuf, from->stpbuf, sizeof(sigjmp_buf));
+  if (sigsetjmp(from->yldbuf, 0) == 0)
+    siglongjmp(to->yldbuf, 1); /* Never returns */
+
+  return true;
+}
+
 void
-eng_ucontext_cancel(qlStateUContext **state)
+eng_ucontext_unwind(qlStateUContext *state)
 {
+  if (state->state.flags & QL_FLAG_NOSIGMASK)
+    siglongjmp(state->topbuf, 1);
+
+  state->jumped = STATUS_RETURN;
+  setcontext(&state->stpctx);
+  abort(); /* Never get here */
+}
 
+void
+eng_ucontext_free(qlStateUContext *state)
+{
 }
@@ -28,55 +28,246 @@
 #endif
 
 #define MAXENGINES 32
+#define POOL_BUCKETS 8
+#define POOL_DEPTH 256
+
+/* The alignment of the data of ql_state_new_data() (max_align_t). */
+#define DATA_ALIGN 16
 #define ENGINE_DEFINITIONS(name) \
   size_t eng_ ## name ## _size(void); \
   size_t eng_ ## name ## _align(void); \
   size_t eng_ ## name ## _stack(void); \
   bool   eng_ ## name ## _init(qlState *); \
   bool   eng_ ## name ## _step(qlState *); \
-  void   eng_ ## name ## _yield(qlState *);
-#define ENGINE_ENTRY(name) { # name, \
+  void   eng_ ## name ## _yield(qlState *); \
+  bool   eng_ ## name ## _transfer(qlState *, qlState *); \
+  void   eng_ ## name ## _unwind(qlState *) __attribute__ ((noreturn)); \
+  void   eng_ ## name ## _free(qlState *);
+#define ENGINE_ENTRY(name, flags) { # name, flags, \
   eng_ ## name ## _size, \
   eng_ ## name ## _align, \
   eng_ ## name ## _stack, \
   eng_ ## name ## _init, \
   eng_ ## name ## _step, \
-  eng_ ## name ## _yield \
+  eng_ ## name ## _yield, \
+  eng_ ## name ## _transfer, \
+  eng_ ## name ## _unwind, \
+  eng_ ## name ## _free \
 }
 
+/* A build with a single engine (configure --with-engine) calls it directly
+ * instead of through its qlStateEngine, so that the compiler (or the linker,
+ * with -flto) can inline the switch into ql_state_step() and
+ * ql_state_yield(). */
+#ifdef WITH_ENGINE
+#define ENGINE_FUNC(name, func)  ENGINE_FUNC_(name, func)
+#define ENGINE_FUNC_(name, func) eng_ ## name ## _ ## func
+#define ENGINE_CALL(state, func) ENGINE_FUNC(WITH_ENGINE, func)(state)
+#define ENGINE_TRANSFER(from, to) ENGINE_FUNC(WITH_ENGINE, transfer)(from, to)
+#else
+#define ENGINE_CALL(state, func) (state)->eng->func(state)
+#define ENGINE_TRANSFER(from, to) (from)->eng->transfer(from, to)
+#endif
+
 struct qlStateEngine {
   const char *name;
+  int         flags;
   size_t (*size)(void);
   size_t (*align)(void);
   size_t (*stack)(void);
   bool   (*init)(qlState *);
   bool   (*step)(qlState *);
   void   (*yield)(qlState *);
+  bool   (*transfer)(qlState *, qlState *);
+  void   (*unwind)(qlState *);  /* Leaves the function, as if it returned */
+  void   (*free)(qlState *);
 };
 
+#ifdef WITH_FCONTEXT
+ENGINE_DEFINITIONS(fcontext);
+#endif
 #ifdef WITH_SETJMP
 ENGINE_DEFINITIONS(setjmp);
 #endif
 #ifdef WITH_UCONTEXT
 ENGINE_DEFINITIONS(ucontext);
 #endif
-#ifdef WITH_PTHREAD
+#ifdef WITH_PTHREAD_ENGINE
 ENGINE_DEFINITIONS(pthread);
 #endif
 
 static const qlStateEngine engines[] = {
+#ifdef WITH_FCONTEXT
+  ENGINE_ENTRY(fcontext, ENGINE_SHAREDSTACK | ENGINE_NOFPU),
+#endif
 #ifdef WITH_SETJMP
-  ENGINE_ENTRY(setjmp),
+  ENGINE_ENTRY(setjmp, ENGINE_SHAREDSTACK),
 #endif
 #ifdef WITH_UCONTEXT
-  ENGINE_ENTRY(ucontext),
+  ENGINE_ENTRY(ucontext, 0),
 #endif
-#ifdef WITH_PTHREAD
-  ENGINE_ENTRY(pthread),
+#ifdef WITH_PTHREAD_ENGINE
+  ENGINE_ENTRY(pthread, ENGINE_OWNSTACK),
 #endif
-  { NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+  { NULL, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL }
 };
 
+/* A per-thread cache of recycled qlStates (and their stacks). Each bucket
+ * holds states which are interchangeable: same engine, stack, flags and
+ * data size. */
+typedef struct {
+  const qlStateEngine *eng;
+  size_t               size;
+  qlFlags              flags;
+  size_t               datasize;
+  const qlAllocator   *alloc;
+  size_t               count;
+  qlState             *head;
+} poolBucket;
+
+static __thread poolBucket pool[POOL_BUCKETS];
+
+/* The allocator of the calling thread's qlStates (see ql_allocator_set()). */
+static __thread const qlAllocator *allocator;
+
+static poolBucket *
+pool_bucket(const qlStateEngine *eng, size_t size, qlFlags flags,
+            size_t datasize, const qlAllocator *alloc, bool add)
+{
+  poolBucket *empty = NULL;
+  int i;
+
+  for (i = 0; i < POOL_BUCKETS; i++) {
+    if (!pool[i].eng) {
+      if (!empty)
+        empty = &pool[i];
+      continue;
+    }
+
+    if (pool[i].eng == eng && pool[i].size == size &&
+        pool[i].flags == flags && pool[i].datasize == datasize &&
+        pool[i].alloc == alloc)
+      return &pool[i];
+  }
+
+  if (!add || !empty)
+    return NULL;
+
+  empty->eng = eng;
+  empty->size = size;
+  empty->flags = flags;
+  empty->datasize = datasize;
+  empty->alloc = alloc;
+  return empty;
+}
+
+static bool
+state_cancel(qlState *state);
+
+/* Allocates the stack and engine resources of a state: when it is created,
+ * or on its first step with QL_FLAG_LAZYSTACK. */
+static bool
+state_acquire(qlState *state)
+{
+  if (!(state->eng->flags & ENGINE_OWNSTACK) &&
+      !stack_alloc(state, state->eng->align()))
+    return false;
+
+  if (!ENGINE_CALL(state, init)) {
+    stack_free(state);
+    return false;
+  }
+
+  state->ready = true;
+  return true;
+}
+
+static void
+state_release(qlState *state)
+{
+  stack_record(state);
+  ENGINE_CALL(state, free);
+  stack_free(state);
+  state->ready = false;
+}
+
+static void
+state_free(void *mem)
+{
+  qlState *state = mem;
+
+  /* A suspended state cleans up after itself before it goes away. */
+  if (state->cleanup && state->status == STATUS_YIELD && !state->sched)
+    state_cancel(state);
+
+  if (state->ready)
+    state_release(state);
+}
+
+/* The size of a qlState's own block, with its data. */
+static size_t
+state_size(const qlStateEngine *engine, size_t datasize)
+{
+  size_t offset;
+
+  if (datasize == 0)
+    return engine->size();
+
+  offset = (engine->size() + DATA_ALIGN - 1) & ~(size_t) (DATA_ALIGN - 1);
+  return offset + datasize;
+}
+
+/* Whether a qlState from an allocator carries its stack in its block. */
+static bool
+state_has_stack(const qlStateEngine *engine, qlFlags flags)
+{
+  return !(engine->flags & ENGINE_OWNSTACK) &&
+         !(flags & (QL_FLAG_MMAPSTACK | QL_FLAG_SHAREDSTACK));
+}
+
+/* Allocates a zeroed qlState (and its stack, if it has one in the block)
+ * from an allocator. */
+static qlState *
+state_alloc(const qlAllocator *alloc, const qlStateEngine *engine,
+            size_t head, size_t stack, qlFlags flags)
+{
+  size_t align = engine->align(), total = head;
+  qlState *state;
+
+  if (align < DATA_ALIGN)
+    align = DATA_ALIGN;
+
+  head = (head + align - 1) & ~(align - 1);
+  if (state_has_stack(engine, flags))
+    total = head + stack;
+
+  state = alloc->alloc(alloc->ctx, total, align);
+  if (!state)
+    return NULL;
+
+  memset(state, 0, head);
+  state->alloc = alloc;
+  state->allocsize = total;
+  if (total > head)
+    state->stack = (char *) state + head;
+
+  return state;
+}
+
+/* Frees a qlState which failed to initialize, or which was never handed
+ * out. */
+static void
+state_discard(void *parent, qlState *state)
+{
+  if (state->alloc) {
+    if (state->alloc->free)
+      state->alloc->free(state->alloc->ctx, state, state->allocsize);
+    return;
+  }
+
+  sc_decref(parent, state);
+}
+
 size_t
 get_pagesize()
 {
@@ -110,73 +301,595 @@ ql_engine_list()
   return enames;
 }
 
+/* Finds an engine by name. The names from ql_engine_list() match by
+ * address, without comparing strings. */
+static const qlStateEngine *
+engine_find(const char *eng)
+{
+  int i;
+
+  for (i = 0; engines[i].name; i++) {
+    if (!eng || eng == engines[i].name || !strcmp(engines[i].name, eng))
+      return &engines[i];
+  }
+
+  return NULL;
+}
+
+qlFlags
+ql_engine_get_flags(const char *eng)
+{
+  const qlStateEngine *engine = engine_find(eng);
+  qlFlags flags;
+
+  if (!engine)
+    return QL_FLAG_NONE;
+  if (engine->flags & ENGINE_OWNSTACK)
+    return QL_FLAG_LAZYSTACK;
+
+  flags = QL_FLAG_NOSIGMASK | QL_FLAG_MMAPSTACK | QL_FLAG_STACKPAINT |
+          QL_FLAG_STACKAUTO | QL_FLAG_LAZYSTACK;
+  if (engine->flags & ENGINE_SHAREDSTACK)
+    flags |= QL_FLAG_SHAREDSTACK;
+  if (engine->flags & ENGINE_NOFPU)
+    flags |= QL_FLAG_NOFPU;
+
+  return flags;
+}
+
+size_t
+ql_allocator_size(const char *eng, size_t pages, qlFlags flags, size_t size)
+{
+  const qlStateEngine *engine = engine_find(eng);
+  size_t align, head;
+
+  if (!engine)
+    return 0;
+
+  if (pages < engine->stack())
+    pages = engine->stack();
+  if (!(engine->flags & ENGINE_SHAREDSTACK))
+    flags &= ~QL_FLAG_SHAREDSTACK;
+  if (!(engine->flags & ENGINE_NOFPU))
+    flags &= ~QL_FLAG_NOFPU;
+
+  align = engine->align() < DATA_ALIGN ? DATA_ALIGN : engine->align();
+  head = (state_size(engine, size) + align - 1) & ~(align - 1);
+  if (!state_has_stack(engine, flags))
+    return head;
+
+  return head + pages * get_pagesize();
+}
+
 qlState *
 ql_state_new(void *parent, const char *eng, qlFunction *func, size_t pages)
 {
-  const qlStateEngine *engine = NULL;
+  return ql_state_new_flags(parent, eng, func, pages, QL_FLAG_NONE);
+}
+
+qlState *
+ql_state_new_flags(void *parent, const char *eng, qlFunction *func,
+                   size_t pages, qlFlags flags)
+{
+  return ql_state_new_data(parent, eng, func, pages, flags, 0);
+}
+
+qlState *
+ql_state_new_data(void *parent, const char *eng, qlFunction *func,
+                  size_t pages, qlFlags flags, size_t size)
+{
+  const qlStateEngine *engine;
+  size_t offset;
   qlState *state;
-  int i;
 
   if (!func)
     return NULL;
 
-  for (i = 0; engines[i].name; i++) {
-    if (!eng || !strcmp(engines[i].name, eng)) {
-      engine = &engines[i];
-      break;
-    }
-  }
+  engine = engine_find(eng);
   if (!engine)
     return NULL;
 
+  if (flags & QL_FLAG_STACKAUTO) {
+    size_t advised = ql_stack_advise(func);
+    if (advised)
+      pages = advised;
+    flags |= QL_FLAG_STACKPAINT;
+  }
+
   if (pages < engine->stack())
     pages = engine->stack();
 
-  state = sc_malloc0(parent, engine->size(), "qlState");
+  if (!(engine->flags & ENGINE_SHAREDSTACK))
+    flags &= ~QL_FLAG_SHAREDSTACK;
+  if (!(engine->flags & ENGINE_NOFPU))
+    flags &= ~QL_FLAG_NOFPU;
+
+  /* Only a stack of the state's own can be painted. */
+  if ((engine->flags & ENGINE_OWNSTACK) || (flags & QL_FLAG_SHAREDSTACK))
+    flags &= ~QL_FLAG_STACKPAINT;
+
+  /* Reuse a recycled state, if we have one. */
+  if (!parent) {
+    poolBucket *bucket;
+
+    bucket = pool_bucket(engine, pages * get_pagesize(), flags, size,
+                         allocator, false);
+    if (bucket && bucket->head) {
+      state = bucket->head;
+      bucket->head = state->next;
+      if (--bucket->count == 0)
+        bucket->eng = NULL;
+
+      state->next = NULL;
+      if (state->origin != func)
+        state->origin = NULL;
+      state->func = func;
+      state->param = NULL;
+      state->status = 0;
+      state->sched = NULL;
+      state->deadline = 0;
+      memset(&state->stats, 0, sizeof(state->stats));
+      state->yielded = 0;
+      return state;
+    }
+  }
+
+  offset = (engine->size() + DATA_ALIGN - 1) & ~(size_t) (DATA_ALIGN - 1);
+  if (!parent && allocator)
+    state = state_alloc(allocator, engine, state_size(engine, size),
+                        pages * get_pagesize(), flags);
+  else
+    state = sc_malloc0(parent, state_size(engine, size), "qlState");
   if (!state)
     return NULL;
 
+  if (size > 0) {
+    state->data = (char *) state + offset;
+    state->datasize = size;
+  }
+
   state->eng = engine;
   state->func = func;
-  state->stack = sc_memalign(state, engine->align(),
-                             pages * get_pagesize(), "qlStack");
-  if (!state->stack) {
-    sc_decref(parent, state);
+  state->origin = func;
+  state->flags = flags;
+  state->size = pages * get_pagesize();
+  if (!(flags & QL_FLAG_LAZYSTACK) && !state_acquire(state)) {
+    state_discard(parent, state);
     return NULL;
   }
 
-  if (!state->eng->init(state)) {
-    sc_decref(parent, state);
-    return NULL;
+  if (!state->alloc)
+    sc_destructor_set(state, state_free);
+  return state;
+}
+
+/* Finishes a step of root which moved control on to other states with
+ * ql_state_transfer(): makes the transfers which their engine left to the
+ * stepper, and then reports on the state which gave control back. */
+static bool
+state_handoff(qlState *root)
+{
+  qlState *active;
+
+  while ((active = root->handoff)) {
+    root->handoff = NULL;
+    ENGINE_CALL(active, step);
   }
 
-  return state;
+  /* A state which yielded says so; one which returned is still running. */
+  active = root->active;
+  if (active == root)
+    return root->status == STATUS_YIELD;
+
+  active->status = active->status == STATUS_YIELD ? STATUS_YIELD
+                                                  : STATUS_RETURN;
+  if (active->status == STATUS_RETURN && (active->flags & QL_FLAG_LAZYSTACK))
+    state_release(active);
+  root->param = active->param;
+  return true;
 }
 
-bool
-ql_state_step(qlState *state, qlParameter* param)
+static inline bool
+state_step(qlState *state, qlParameter* param)
 {
   bool rslt;
 
-  assert(state);
+  if (((state->flags & QL_FLAG_LAZYSTACK) && !state->ready &&
+       !state_acquire(state)) ||
+      ((state->flags & QL_FLAG_SHAREDSTACK) && !shared_enter(state))) {
+    if (param)
+      *param = NULL;
+    return false;
+  }
 
   state->param = param ? *param : NULL;
-  rslt = state->eng->step(state);
+  state->status = STATUS_RUNNING;
+  state->root = NULL;
+  state->active = state;
+  rslt = ENGINE_CALL(state, step);
+  if (__builtin_expect(state->active != state || state->handoff, 0))
+    rslt = state_handoff(state);
+  state->status = rslt ? STATUS_YIELD : STATUS_RETURN;
+  if (!rslt)
+    state->cleanup = NULL;
+
+  if (state->flags & QL_FLAG_SHAREDSTACK)
+    shared_leave(state, rslt);
+  if (!rslt && (state->flags & QL_FLAG_LAZYSTACK))
+    state_release(state);
 
   if (param)
     *param = state->param;
   return rslt;
 }
 
+/* Runs the handlers of a state resumed by state_cancel(), on its stack,
+ * and then leaves its function. */
+static void __attribute__ ((noreturn, noinline))
+state_unwind(qlState *state)
+{
+  qlCleanup *cleanup;
+
+  while ((cleanup = state->cleanup)) {
+    state->cleanup = cleanup->next;
+    cleanup->func(cleanup->arg);
+  }
+
+  state->param = NULL;
+  ENGINE_CALL(state, unwind);
+  abort(); /* Never get here */
+}
+
+static bool
+state_cancel(qlState *state)
+{
+  if (state->status != STATUS_YIELD || state->sched)
+    return false;
+
+  state->cancel = true;
+  state_step(state, NULL);
+  state->cancel = false;
+  return true;
+}
+
+void *
+ql_state_data(qlState *state)
+{
+  return state ? state->data : NULL;
+}
+
+bool
+ql_state_step(qlState *state, qlParameter* param)
+{
+  uint64_t start;
+  bool rslt;
+
+  assert(state);
+  assert(!__atomic_load_n(&state->detached, __ATOMIC_RELAXED));
+
+  if (STATS_ENABLED()) {
+    start = stats_begin(state);
+    rslt = state_step(state, param);
+    stats_end(state, start);
+    return rslt;
+  }
+
+  return state_step(state, param);
+}
+
+size_t
+ql_state_step_many(qlState **states, qlParameter *params, size_t count,
+                   bool *results)
+{
+  size_t i, yielded = 0;
+  qlState *next;
+  bool rslt;
+
+  if (count > 0 && states[0])
+    __builtin_prefetch(states[0]);
+
+  for (i = 0; i < count; i++) {
+    /* The next state's head was prefetched one step ago: fetch what it
+     * points at now, and the head of the one after. The engine's saved
+     * context follows the qlState in the engine's own struct. */
+    if (i + 2 < count && states[i + 2])
+      __builtin_prefetch(states[i + 2]);
+    if (i + 1 < count && (next = states[i + 1])) {
+      __builtin_prefetch(next + 1);
+      if (next->status == STATUS_YIELD && next->sp)
+        __builtin_prefetch(next->sp, 1);
+    }
+
+    if (!states[i]) {
+      if (results)
+        results[i] = false;
+      continue;
+    }
+
+    rslt = ql_state_step(states[i], params ? &params[i] : NULL);
+    if (results)
+      results[i] = rslt;
+    yielded += rslt;
+  }
+
+  return yielded;
+}
+
 void
 ql_state_yield(qlState *state, qlParameter* param)
 {
   assert(state);
 
+  if (STATS_ENABLED())
+    stats_yield(state);
+
   state->func = NULL;
   state->param = param ? *param : NULL;
-  state->eng->yield(state);
+  state->status = STATUS_YIELD;
+  ENGINE_CALL(state, yield);
+  if (__builtin_expect(state->cancel, 0))
+    state_unwind(state);
 
   if (param)
     *param = state->param;
 }
+
+bool
+ql_state_transfer(qlState *from, qlState *to, qlParameter *param)
+{
+  qlState *root;
+
+  assert(from && to);
+
+  if (from == to || from->eng != to->eng ||
+      from->status != STATUS_RUNNING ||
+      (to->status != 0 && to->status != STATUS_YIELD) ||
+      ((from->flags | to->flags) & QL_FLAG_SHAREDSTACK) ||
+      from->sched || to->sched)
+    return false;
+
+  if ((to->flags & QL_FLAG_LAZYSTACK) && !to->ready && !state_acquire(to))
+    return false;
+
+  if (STATS_ENABLED())
+    stats_yield(from);
+
+  /* to gives control back to the stepper of the chain's first state. */
+  root = from->root ? from->root : from;
+  from->func = NULL;
+  from->status = STATUS_YIELD;
+  to->param = param ? *param : NULL;
+  to->status = STATUS_RUNNING;
+  to->root = root;
+  root->active = to;
+
+  /* An engine which can't switch between the two stacks directly yields
+   * to the stepper, which then steps to. */
+  if (!ENGINE_TRANSFER(from, to)) {
+    root->handoff = to;
+    ENGINE_CALL(from, yield);
+  }
+  if (__builtin_expect(from->cancel, 0))
+    state_unwind(from);
+
+  if (param)
+    *param = from->param;
+  return true;
+}
+
+void
+ql_state_cleanup_push(qlState *state, qlCleanup *cleanup,
+                      void (*func)(void *arg), void *arg)
+{
+  assert(state && cleanup && func);
+
+  cleanup->func = func;
+  cleanup->arg = arg;
+  cleanup->next = state->cleanup;
+  state->cleanup = cleanup;
+}
+
+void
+ql_state_cleanup_pop(qlState *state, bool run)
+{
+  qlCleanup *cleanup;
+
+  assert(state && state->cleanup);
+
+  cleanup = state->cleanup;
+  state->cleanup = cleanup->next;
+  if (run)
+    cleanup->func(cleanup->arg);
+}
+
+bool
+ql_state_cancel(qlState *state)
+{
+  return state ? state_cancel(state) : false;
+}
+
+bool
+ql_state_detach(qlState *state)
+{
+  if (!state || state->status == STATUS_RUNNING || state->sched ||
+      (state->flags & QL_FLAG_SHAREDSTACK))
+    return false;
+
+  return !__atomic_exchange_n(&state->detached, true, __ATOMIC_RELEASE);
+}
+
+bool
+ql_state_attach(qlState *state)
+{
+  return state &&
+         __atomic_exchange_n(&state->detached, false, __ATOMIC_ACQUIRE);
+}
+
+bool
+ql_state_reset(qlState *state, qlFunction *func)
+{
+  if (!state || !func)
+    return false;
+
+  if (state->status == STATUS_RUNNING || state->status == STATUS_YIELD)
+    return false;
+
+  stack_record(state);
+  if (state->origin != func)
+    state->origin = NULL;
+  state->func = func;
+  state->param = NULL;
+  state->status = 0;
+  memset(&state->stats, 0, sizeof(state->stats));
+  state->yielded = 0;
+  return true;
+}
+
+void
+ql_state_recycle(void *parent, qlState *state)
+{
+  poolBucket *bucket;
+
+  if (!state)
+    return;
+
+  /* The memory of an allocator without free() may go away at any time. */
+  if (!parent && state->status != STATUS_RUNNING &&
+                 state->status != STATUS_YIELD &&
+                 (!state->alloc || state->alloc->free)) {
+    bucket = pool_bucket(state->eng, state->size, state->flags,
+                         state->datasize, state->alloc, true);
+    if (bucket && bucket->count < POOL_DEPTH) {
+      stack_record(state);
+      state->next = bucket->head;
+      bucket->head = state;
+      bucket->count++;
+      return;
+    }
+  }
+
+  if (state->alloc)
+    ql_state_free(state);
+  else
+    sc_decref(parent, state);
+}
+
+void
+ql_state_pool_clear()
+{
+  qlState *state;
+  int i;
+
+  for (i = 0; i < POOL_BUCKETS; i++) {
+    while ((state = pool[i].head)) {
+      pool[i].head = state->next;
+      ql_state_free(state);
+    }
+
+    pool[i].eng = NULL;
+    pool[i].count = 0;
+  }
+}
+
+const qlAllocator *
+ql_allocator_set(const qlAllocator *alloc)
+{
+  const qlAllocator *prev = allocator;
+
+  allocator = alloc;
+  return prev;
+}
+
+void
+ql_state_free(qlState *state)
+{
+  if (!state)
+    return;
+
+  if (!state->alloc) {
+    sc_decref(NULL, state);
+    return;
+  }
+
+  state_free(state);
+  state_discard(NULL, state);
+}
+
+/* Gives the blocks of states from allocators back, a group of states of
+ * the same allocator at a time. This reorders blocks. */
+static void
+state_return_many(qlState **blocks, size_t count)
+{
+  size_t i, j, k;
+
+  for (i = 0; i < count; i = k) {
+    const qlAllocator *alloc = blocks[i]->alloc;
+
+    /* Move the rest of this allocator's states up next to the first. */
+    for (j = k = i + 1; j < count; j++) {
+      if (blocks[j]->alloc == alloc) {
+        qlState *tmp = blocks[k];
+        blocks[k++] = blocks[j];
+        blocks[j] = tmp;
+      }
+    }
+
+    if (slab_free_many(alloc, (void **) &blocks[i], k - i))
+      continue;
+
+    for (j = i; j < k; j++)
+      alloc->free(alloc->ctx, blocks[j], blocks[j]->allocsize);
+  }
+}
+
+void
+ql_state_free_many(qlState **states, size_t count)
+{
+  size_t i, nranges = 0, nblocks = 0;
+  stackRange *ranges;
+  qlState **blocks;
+
+  if (!states || count == 0)
+    return;
+
+  /* Unwind first, so that the frees below don't switch stacks. */
+  for (i = 0; i < count; i++) {
+    if (states[i] && states[i]->cleanup)
+      state_cancel(states[i]);
+  }
+
+  ranges = malloc(count * (sizeof(stackRange) + sizeof(qlState *)));
+  if (!ranges) {
+    for (i = 0; i < count; i++)
+      ql_state_free(states[i]);
+    return;
+  }
+  blocks = (qlState **) (ranges + count);
+
+  /* Release what each state holds, but keep back the mapped stacks and
+   * the blocks from allocators, to give them back together. */
+  for (i = 0; i < count; i++) {
+    qlState *state = states[i];
+
+    if (!state)
+      continue;
+
+    if (state->ready) {
+      stack_record(state);
+      ENGINE_CALL(state, free);
+      if (stack_take(state, &ranges[nranges]))
+        nranges++;
+      stack_free(state);
+      state->ready = false;
+    }
+
+    if (!state->alloc)
+      sc_decref(NULL, state);
+    else if (state->alloc->free)
+      blocks[nblocks++] = state;
+  }
+
+  stack_unmap_many(ranges, nranges);
+  state_return_many(blocks, nblocks);
+  free(ranges);
+}
@@ -24,9 +24,169 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
 
 typedef void *qlParameter;
 typedef struct qlState qlState;
+typedef struct qlScheduler qlScheduler;
+typedef struct qlChannel qlChannel;
+typedef struct qlSlab qlSlab;
+typedef unsigned int qlFlags;
+
+/*
+ * Flags for ql_state_new_flags().
+ *
+ * QL_FLAG_NOSIGMASK - Don't save or restore the signal mask when switching.
+ *                     Engines which would otherwise make a system call on
+ *                     every switch (ucontext) can then switch entirely in
+ *                     userspace. Only use this if the coroutine doesn't
+ *                     change the signal mask.
+ *
+ * QL_FLAG_MMAPSTACK - Map the stack directly from the kernel (mmap()), with
+ *                     an inaccessible guard page below it. A stack overflow
+ *                     then crashes immediately instead of silently corrupting
+ *                     memory. Since the stack's pages are only committed once
+ *                     they are touched, generous stack sizes cost only the
+ *                     memory actually used. Creating such a qlState is more
+ *                     expensive, so consider ql_state_recycle().
+ *
+ * QL_FLAG_SHAREDSTACK - Run on a stack shared with other qlStates of the same
+ *                     stack size (fcontext and setjmp engines only). When a
+ *                     qlState needs the stack, the frames of the qlState
+ *                     currently on it are copied out into a right-sized
+ *                     buffer, and copied back when that one is stepped again.
+ *                     A suspended qlState thus only costs the stack it has
+ *                     actually used, at the price of a copy when switching
+ *                     between qlStates. Pointers to data on the stack of such
+ *                     a qlState must never be used by other coroutines. The
+ *                     qlState must only be stepped by the thread which first
+ *                     stepped it, and never from a coroutine running on the
+ *                     same shared stack.
+ *
+ * QL_FLAG_STACKPAINT - Fill the stack with a known pattern when it is
+ *                     allocated, so that ql_state_stack_used() can tell how
+ *                     deep the stack has been used. When the qlState is
+ *                     freed, reset or recycled, its usage is recorded in
+ *                     the profile of its qlFunction (see ql_stack_advise()).
+ *                     Painting writes the whole stack once, which also
+ *                     commits every page of a QL_FLAG_MMAPSTACK stack.
+ *                     Ignored by engines without a stack of their own
+ *                     (pthread) and with QL_FLAG_SHAREDSTACK.
+ *
+ * QL_FLAG_STACKAUTO - Size the stack by the profile of the qlFunction (see
+ *                     ql_stack_advise()), if it has one, instead of by the
+ *                     pages parameter. Implies QL_FLAG_STACKPAINT, so the
+ *                     profile keeps learning. A profile only knows the
+ *                     paths which were taken so far, so combine this with
+ *                     QL_FLAG_MMAPSTACK to crash on an overflow instead of
+ *                     corrupting memory.
+ *
+ * QL_FLAG_NOFPU     - Don't save or restore the floating point and SIMD
+ *                     control state (on x86_64, MXCSR and the x87 control
+ *                     word) when switching. Only use this if the coroutine
+ *                     doesn't change the rounding mode, exception masks or
+ *                     the like; the coroutine then runs with its stepper's
+ *                     control state. Only the fcontext engine saves this
+ *                     state to begin with: the setjmp engine (and ucontext
+ *                     with QL_FLAG_NOSIGMASK) never do, while ucontext
+ *                     without it can't skip it.
+ *
+ * QL_FLAG_LAZYSTACK - Don't allocate the stack (or the engine's resources,
+ *                     such as the pthread engine's thread) until the first
+ *                     ql_state_step(), and release them as soon as the
+ *                     qlFunction returns (or the qlState is cancelled).
+ *                     A qlState which is never stepped then costs only its
+ *                     own memory, and a finished one doesn't hold on to a
+ *                     stack until it is freed; the stack is allocated anew
+ *                     when it is reset (or recycled) and stepped again. A
+ *                     stack which is part of the qlState's block (see
+ *                     ql_allocator_set()) is kept, but its engine
+ *                     resources are still deferred. If the resources can't
+ *                     be allocated, ql_state_step() returns false at once,
+ *                     with a NULL parameter.
+ */
+#define QL_FLAG_NONE        0x00
+#define QL_FLAG_NOSIGMASK   0x01
+#define QL_FLAG_MMAPSTACK   0x02
+#define QL_FLAG_SHAREDSTACK 0x04
+#define QL_FLAG_STACKPAINT  0x08
+#define QL_FLAG_STACKAUTO   0x10
+#define QL_FLAG_NOFPU       0x20
+#define QL_FLAG_LAZYSTACK   0x40
+
+/*
+ * Flags for ql_slab_new_flags().
+ *
+ * QL_SLAB_HUGEPAGES - Map the slab's memory in chunks of (at least) 2MiB,
+ *                     aligned for transparent huge pages, and ask the
+ *                     kernel to back them with huge pages. Many stacks
+ *                     then share a few TLB entries.
+ *
+ * QL_SLAB_NUMA      - Keep the blocks of each NUMA node apart: a thread
+ *                     gets blocks from its own node's chunks, whose memory
+ *                     the kernel places on that node when it can. A freed
+ *                     block goes back to its node, whichever thread frees
+ *                     it.
+ *
+ * Both are only honored on Linux; elsewhere they are ignored.
+ */
+#define QL_SLAB_NONE      0x00
+#define QL_SLAB_HUGEPAGES 0x01
+#define QL_SLAB_NUMA      0x02
+
+/*
+ * Flags for ql_chan_new().
+ *
+ * QL_CHAN_SPSC - The channel has a single sender and a single receiver (at
+ *                a time). Sending and receiving are then lock free.
+ */
+#define QL_CHAN_NONE 0x00
+#define QL_CHAN_SPSC 0x01
+
+/*
+ * Runtime statistics, from ql_state_stats() or ql_stats_total().
+ *
+ * Times are in nanoseconds of the monotonic clock (CLOCK_MONOTONIC). The
+ * time spent running a coroutine includes the time spent in coroutines it
+ * steps in turn.
+ */
+typedef struct {
+  unsigned long long steps;     /* Calls to ql_state_step() */
+  unsigned long long yields;    /* Calls to ql_state_yield() */
+  unsigned long long running;   /* Time spent running in the coroutine */
+  unsigned long long suspended; /* Time spent suspended between steps */
+  unsigned long long resumed;   /* When it was last stepped, or 0 */
+} qlStats;
+
+/*
+ * A memory allocator for qlStates (see ql_allocator_set()).
+ *
+ * alloc() returns size bytes aligned to align (a power of two), or NULL.
+ * free() gives back a block from alloc(), with the size it was asked for;
+ * it may be NULL for allocators which release their memory all at once,
+ * such as arenas.
+ */
+typedef struct {
+  void *(*alloc)(void *ctx, size_t size, size_t align);
+  void  (*free)(void *ctx, void *mem, size_t size);
+  void   *ctx;
+} qlAllocator;
+
+/*
+ * A cleanup handler, for ql_state_cleanup_push().
+ *
+ * The qlCleanup is provided by the caller, usually as a local variable of
+ * the qlFunction, and must stay put until it is popped.
+ */
+typedef struct qlCleanup qlCleanup;
+struct qlCleanup {
+  qlCleanup *next;
+  void     (*func)(void *arg);
+  void      *arg;
+};
 
 /* A function which can be yield()ed from. */
 typedef qlParameter
@@ -48,6 +208,7 @@ extern "C"
  * performance. Not all engines are available in every build.
  *
  * Possible engines include:
+ *   fcontext - FASTEST - x86_64 only (switches registers in assembly).
  *   setjmp   - FAST - limited CPU architecture support (due to assembly code).
  *   ucontext - FAST - broad architecture/platform support.
  *   pthread  - SLOW - very broad architecture/platform support.
@@ -59,6 +220,24 @@ extern "C"
 const char * const *
 ql_engine_list();
 
+/*
+ * Gets the flags which an engine honors.
+ *
+ * This returns the QL_FLAG_* values which the engine acts upon; it silently
+ * ignores the others (see ql_state_new_flags()). For instance, only engines
+ * which return QL_FLAG_SHAREDSTACK can share stacks.
+ *
+ * If eng is NULL, the flags of the default engine are returned. An invalid
+ * engine has no flags (QL_FLAG_NONE).
+ *
+ * @see ql_engine_list()
+ * @see ql_state_new_flags()
+ * @param eng The name of the engine or NULL.
+ * @return The QL_FLAG_* flags honored by the engine.
+ */
+qlFlags
+ql_engine_get_flags(const char *eng);
+
 /*
  * Initializes a coroutine to be called.
  *
@@ -74,12 +253,17 @@ ql_engine_list();
  * in doubt, PTHREAD_STACK_MIN on your platform should give you a hint). If you
  * specify less than this, then size will be silently up-sized to the minimum
  * number. Use caution in choosing your stack size to prevent crashes and data
- * corruption.
+ * corruption. QL_FLAG_STACKPAINT and ql_stack_advise() help to find the size
+ * a qlFunction actually needs.
+ *
+ * If parent is NULL, a qlState cached by ql_state_recycle() on this thread may
+ * be returned instead of a newly allocated one.
  *
  * The qlState must be freed using the standard libsc conventions. Because of
  * this, it is wise to allocate resources using standard libsc conventions as
  * children of the qlState. This ensures that if the co-routine is cancelled,
  * proper cleanup will happen for all resources allocated within the co-routine.
+ * (A qlState from an allocator, see ql_allocator_set(), is no libsc object.)
  *
  * @see ql_engine_list()
  * @see ql_state_step()
@@ -92,6 +276,59 @@ ql_engine_list();
 qlState *
 ql_state_new(void *parent, const char *eng, qlFunction *func, size_t pages);
 
+/*
+ * Initializes a coroutine to be called, with flags.
+ *
+ * This is identical to ql_state_new() except that the flags parameter
+ * (a bitwise OR of the QL_FLAG_* values) tunes the behavior of the qlState.
+ * Engines silently ignore flags which don't apply to them.
+ *
+ * @see ql_state_new()
+ * @param parent The memory parent (libsc)
+ * @param eng The name of the engine desired or NULL.
+ * @param func The function to call.
+ * @param pages The number of stack pages to pre-allocate.
+ * @param flags The QL_FLAG_* flags.
+ * @return The qlState to step/yield.
+ */
+qlState *
+ql_state_new_flags(void *parent, const char *eng, qlFunction *func,
+                   size_t pages, qlFlags flags);
+
+/*
+ * Initializes a coroutine to be called, with room for data of its own.
+ *
+ * This is identical to ql_state_new_flags() except that size bytes of
+ * zeroed memory are allocated along with the qlState, in the same block.
+ * ql_state_data() returns them. The memory is suitably aligned for any
+ * type (max_align_t), and lives as long as the qlState. A qlState taken
+ * from the pool (see ql_state_recycle()) has the same size of data, but
+ * its contents are left as they were.
+ *
+ * @see ql_state_new_flags()
+ * @see ql_state_data()
+ * @param parent The memory parent (libsc)
+ * @param eng The name of the engine desired or NULL.
+ * @param func The function to call.
+ * @param pages The number of stack pages to pre-allocate.
+ * @param flags The QL_FLAG_* flags.
+ * @param size The number of bytes of data.
+ * @return The qlState to step/yield.
+ */
+qlState *
+ql_state_new_data(void *parent, const char *eng, qlFunction *func,
+                  size_t pages, qlFlags flags, size_t size);
+
+/*
+ * Gets the data allocated along with a qlState by ql_state_new_data().
+ *
+ * @see ql_state_new_data()
+ * @param state The state object
+ * @return The data, or NULL if the qlState has none
+ */
+void *
+ql_state_data(qlState *state);
+
 /*
  * Steps through the qlFunction.
  *
@@ -128,6 +365,27 @@ ql_state_new(void *parent, const char *eng, qlFunction *func, size_t pages);
 bool
 ql_state_step(qlState *state, qlParameter *param);
 
+/*
+ * Steps many qlStates, one after another.
+ *
+ * This is the same as calling ql_state_step() on each of the qlStates in
+ * turn (NULLs are skipped), with params[i] (if params isn't NULL) as the
+ * parameter of states[i]. While one qlState runs, the next one's saved
+ * context and the top of its suspended stack are prefetched, so resuming
+ * a large batch of ready coroutines costs fewer cache misses.
+ *
+ * @see ql_state_step()
+ * @param states The state objects
+ * @param params The parameters, or NULL.
+ * @param count The number of state objects.
+ * @param results If not NULL, whether each qlState yielded (true) or
+ *                returned (false), as ql_state_step() returns.
+ * @return The number of qlStates which yielded.
+ */
+size_t
+ql_state_step_many(qlState **states, qlParameter *params, size_t count,
+                   bool *results);
+
 /*
  * Yields control back to ql_state_step().
  *
@@ -156,6 +414,702 @@ ql_state_step(qlState *state, qlParameter *param);
 void
 ql_state_yield(qlState *state, qlParameter *param);
 
+/*
+ * Switches from the running qlState directly to another one.
+ *
+ * This suspends from, as ql_state_yield() does, and resumes to (or starts
+ * it, if it has never been stepped) with the parameter, without going
+ * through from's stepper: one switch instead of two. The fcontext and
+ * setjmp engines (and ucontext, between qlStates with QL_FLAG_NOSIGMASK)
+ * switch stacks directly; the others go through the stepper, but without
+ * returning from its ql_state_step().
+ *
+ * to takes from's place: when to yields or returns, control goes back to
+ * the stepper of from, whose ql_state_step() returns true (from is still
+ * suspended) and the parameter passed by to. to may itself transfer on,
+ * or back to from. from resumes when it is stepped or transferred to; the
+ * parameter is then stored in param before this returns.
+ *
+ * Both qlStates must use the same engine, must not use QL_FLAG_SHAREDSTACK
+ * and must not belong to a scheduler. from must be running (this is
+ * called from its qlFunction) and to must be new or suspended. Transfers
+ * count as yields of from in the statistics (see ql_stats_enable()).
+ *
+ * @see ql_state_yield()
+ * @param from The running state object
+ * @param to The state object to switch to
+ * @param param The parameter to pass back and forth.
+ * @return true once from is resumed, false (at once) if the states can't
+ *         transfer
+ */
+bool
+ql_state_transfer(qlState *from, qlState *to, qlParameter *param);
+
+/*
+ * Registers a cleanup handler of the running qlState.
+ *
+ * Handlers are like those of pthread_cleanup_push(): if the qlState is
+ * cancelled while suspended (see ql_state_cancel()), its handlers run on
+ * its own stack, the most recently pushed first. A qlFunction pops its
+ * handlers before it returns; any left are dropped when it does.
+ *
+ * Example:
+ *   qlParameter myFunc(qlState *state, qlParameter param) {
+ *     qlCleanup cleanup;
+ *     void *buf = malloc(1024);
+ *
+ *     ql_state_cleanup_push(state, &cleanup, free, buf);
+ *     ql_state_yield(state, &param);
+ *     ql_state_cleanup_pop(state, true);
+ *     return param;
+ *   }
+ *
+ * @see ql_state_cleanup_pop()
+ * @see ql_state_cancel()
+ * @param state The running state object
+ * @param cleanup Storage for the handler, until it is popped.
+ * @param func The function to call.
+ * @param arg The argument of func.
+ */
+void
+ql_state_cleanup_push(qlState *state, qlCleanup *cleanup,
+                      void (*func)(void *arg), void *arg);
+
+/*
+ * Unregisters the last cleanup handler pushed, and runs it if run is true.
+ *
+ * @see ql_state_cleanup_push()
+ * @param state The running state object
+ * @param run Whether to call the handler.
+ */
+void
+ql_state_cleanup_pop(qlState *state, bool run);
+
+/*
+ * Cancels a suspended qlState.
+ *
+ * The qlState resumes where it is suspended, runs its cleanup handlers
+ * (see ql_state_cleanup_push()) and then leaves its qlFunction without
+ * running any more of it, as if the qlFunction had returned NULL. The
+ * qlState is then finished: it can be reset, recycled or freed.
+ *
+ * Freeing a suspended qlState with cleanup handlers (with ql_state_free(),
+ * ql_state_free_many() or sc_decref()) cancels it first. Without handlers,
+ * a suspended qlState is simply dropped, without switching to it.
+ *
+ * @see ql_state_cleanup_push()
+ * @see ql_state_free_many()
+ * @param state The state object
+ * @return true if the qlState was cancelled, false if it isn't suspended
+ *         (or it belongs to a scheduler)
+ */
+bool
+ql_state_cancel(qlState *state);
+
+/*
+ * Lets a suspended qlState move to another thread.
+ *
+ * A qlState may be stepped by any thread, one thread at a time, but each
+ * move must be published: the thread giving the qlState up detaches it,
+ * and the thread taking it over attaches it before stepping it. This
+ * orders the qlState's saved context and parameter (and everything the
+ * coroutine wrote before it yielded) before the new thread's step, however
+ * the qlState pointer itself was passed along. A detached qlState must not
+ * be stepped, reset or cancelled until it is attached again.
+ *
+ * Once moved, the coroutine resumes with the new thread's thread-local
+ * data, so it must not hold on to thread-local data (including errno)
+ * across a yield. A qlState on a shared stack (QL_FLAG_SHAREDSTACK) or
+ * owned by a scheduler (which moves its coroutines by itself) can't be
+ * detached; nor can a running one.
+ *
+ * @see ql_state_attach()
+ * @param state The state object
+ * @return true on success, false if the qlState can't move (or is already
+ *         detached)
+ */
+bool
+ql_state_detach(qlState *state);
+
+/*
+ * Takes over a qlState detached by another thread.
+ *
+ * Only one of several threads racing to attach the same qlState succeeds,
+ * so this also serves to claim a qlState offered to many threads.
+ *
+ * @see ql_state_detach()
+ * @param state The state object
+ * @return true if the calling thread now owns the qlState, false if it
+ *         isn't detached
+ */
+bool
+ql_state_attach(qlState *state);
+
+/*
+ * Re-arms a finished qlState with a new qlFunction.
+ *
+ * The qlState keeps its stack and engine resources, so this is far cheaper
+ * than freeing the qlState and creating a new one. The next call to
+ * ql_state_step() calls func, just as for a new qlState.
+ *
+ * Only a qlState which has never been stepped, or whose qlFunction has
+ * returned, can be reset. A suspended qlState can't be.
+ *
+ * @see ql_state_recycle()
+ * @param state The state object
+ * @param func The function to call.
+ * @return true on success, false if the qlState can't be reset
+ */
+bool
+ql_state_reset(qlState *state, qlFunction *func);
+
+/*
+ * Frees a qlState, or caches it for reuse by ql_state_new().
+ *
+ * This can be called in place of sc_decref(parent, state). If parent is
+ * NULL and the qlState isn't suspended, the qlState is cached in a pool
+ * owned by the calling thread. The next ql_state_new(), ql_state_new_flags()
+ * or ql_state_new_data() on this thread with a NULL parent and the same
+ * engine, stack size, flags and data size returns it (reset to the new
+ * qlFunction) instead of allocating a new state and stack. Otherwise, the
+ * qlState is simply freed.
+ *
+ * The pool of each thread is bounded. Use ql_state_pool_clear() to empty
+ * the pool before a thread exits.
+ *
+ * @see ql_state_reset()
+ * @see ql_state_pool_clear()
+ * @param parent The memory parent (libsc)
+ * @param state The state object
+ */
+void
+ql_state_recycle(void *parent, qlState *state);
+
+/*
+ * Frees all qlStates cached by ql_state_recycle() on the calling thread.
+ *
+ * @see ql_state_recycle()
+ */
+void
+ql_state_pool_clear();
+
+/*
+ * Sets the allocator of the qlStates created by the calling thread.
+ *
+ * While an allocator is set, ql_state_new() and friends (and
+ * ql_sched_spawn()) with a NULL parent allocate each qlState with a single
+ * call to it: the state, its data and its stack share one block. Engines
+ * with stacks of their own (pthread), QL_FLAG_MMAPSTACK and
+ * QL_FLAG_SHAREDSTACK still get their stacks elsewhere. The allocator must
+ * outlive every qlState allocated from it, and it may be used (to free
+ * them) from any thread.
+ *
+ * Such a qlState isn't a libsc object: it is freed with ql_state_free() or
+ * ql_state_recycle(), never with sc_decref(). If the allocator has no free()
+ * function, freeing the qlState only releases what the qlState holds
+ * outside of the allocator, and ql_state_recycle() doesn't cache it. A
+ * qlState which holds nothing outside of the allocator (neither pthread
+ * nor QL_FLAG_MMAPSTACK nor QL_FLAG_SHAREDSTACK) can then be dropped along
+ * with the allocator's memory, without any call at all.
+ *
+ * Pass NULL to go back to libsc. Setting the allocator around a single
+ * call gives a per-call allocator.
+ *
+ * @see ql_allocator_size()
+ * @see ql_state_free()
+ * @see ql_slab_new()
+ * @param allocator The allocator, or NULL for libsc.
+ * @return The previous allocator of the thread, or NULL.
+ */
+const qlAllocator *
+ql_allocator_set(const qlAllocator *allocator);
+
+/*
+ * Gets the size of the block which a qlState asks of its allocator.
+ *
+ * This is the size for a qlState from ql_state_new_data() with the same
+ * arguments (the flags and data size are 0 for ql_state_new()), which is
+ * useful to size slabs and arenas. With QL_FLAG_STACKAUTO, pass the pages
+ * advised by ql_stack_advise().
+ *
+ * @see ql_allocator_set()
+ * @param eng The name of the engine desired or NULL.
+ * @param pages The number of stack pages.
+ * @param flags The QL_FLAG_* flags.
+ * @param size The number of bytes of data.
+ * @return The size of the block, or 0 for an invalid engine.
+ */
+size_t
+ql_allocator_size(const char *eng, size_t pages, qlFlags flags, size_t size);
+
+/*
+ * Frees a qlState.
+ *
+ * This frees a qlState which was allocated by an allocator (see
+ * ql_allocator_set()), giving its block back to the allocator. Any other
+ * qlState is freed with sc_decref(NULL, state).
+ *
+ * @see ql_allocator_set()
+ * @param state The state object
+ */
+void
+ql_state_free(qlState *state);
+
+/*
+ * Frees many qlStates at once.
+ *
+ * This is the same as ql_state_free() on each of the qlStates (NULLs are
+ * skipped), but it is meant for tearing down many suspended qlStates, such
+ * as all the coroutines of a connection. The qlStates with cleanup handlers
+ * are cancelled first, one after another. Then their memory is released
+ * in bulk: QL_FLAG_MMAPSTACK stacks are unmapped together (adjacent ones
+ * with a single munmap()), and the blocks of qlStates from a slab (see
+ * ql_slab_new()) go back to it taking each of its locks once. The qlStates
+ * must not belong to a scheduler.
+ *
+ * @see ql_state_cancel()
+ * @see ql_state_free()
+ * @param states The state objects
+ * @param count The number of state objects.
+ */
+void
+ql_state_free_many(qlState **states, size_t count);
+
+/*
+ * Creates a slab allocator of fixed-size blocks.
+ *
+ * The slab hands out blocks of up to size bytes, aligned to the page size,
+ * and carves them count at a time out of larger allocations. Freed blocks
+ * are kept for reuse until the slab itself is freed (with libsc), which
+ * releases all of its memory at once. Use ql_allocator_size() for the size
+ * of a kind of qlState, and ql_slab_allocator() to allocate from the slab.
+ * The slab may be used by many threads.
+ *
+ * @see ql_slab_allocator()
+ * @param parent The memory parent (libsc)
+ * @param size The size of the blocks.
+ * @param count The number of blocks allocated at a time.
+ * @return The slab, or NULL on failure.
+ */
+qlSlab *
+ql_slab_new(void *parent, size_t size, size_t count);
+
+/*
+ * Creates a slab allocator of fixed-size blocks, with flags.
+ *
+ * This is identical to ql_slab_new() except that the flags parameter
+ * (QL_SLAB_*) chooses how the memory of the slab is laid out. With flags,
+ * the slab maps its memory itself (with mmap()) in chunks of a power of
+ * two bytes, each holding at least count blocks, and releases it when the
+ * slab is freed.
+ *
+ * @see ql_slab_new()
+ * @param parent The memory parent (libsc)
+ * @param size The size of the blocks.
+ * @param count The minimum number of blocks allocated at a time.
+ * @param flags The QL_SLAB_* flags.
+ * @return The slab, or NULL on failure.
+ */
+qlSlab *
+ql_slab_new_flags(void *parent, size_t size, size_t count, qlFlags flags);
+
+/*
+ * Gets the allocator of a slab, for ql_allocator_set().
+ *
+ * @see ql_slab_new()
+ * @param slab The slab
+ * @return The slab's allocator.
+ */
+const qlAllocator *
+ql_slab_allocator(qlSlab *slab);
+
+/*
+ * Gets how much of a qlState's stack has been used.
+ *
+ * This is the deepest the stack has been since the qlState was created,
+ * found by scanning the stack for the pattern painted by
+ * QL_FLAG_STACKPAINT. A qlState reused for a different qlFunction (by
+ * ql_state_reset() or the pool) carries the usage over.
+ *
+ * @see QL_FLAG_STACKPAINT
+ * @param state The state object
+ * @return The bytes of stack used, or 0 if the stack isn't painted
+ */
+size_t
+ql_state_stack_used(const qlState *state);
+
+/*
+ * Recommends a stack size for a qlFunction.
+ *
+ * The recommendation is based on the deepest stack usage recorded for the
+ * qlFunction by painted qlStates (see QL_FLAG_STACKPAINT), plus half as
+ * much again for safety, rounded up to whole pages. It is suitable as the
+ * pages parameter of ql_state_new(); QL_FLAG_STACKAUTO applies it
+ * automatically. Profiles are shared by all threads.
+ *
+ * @see QL_FLAG_STACKAUTO
+ * @param func The function
+ * @return The number of stack pages, or 0 if func has no profile
+ */
+size_t
+ql_stack_advise(qlFunction *func);
+
+/*
+ * Enables or disables the collection of runtime statistics.
+ *
+ * Statistics are disabled by default, which costs ql_state_step() and
+ * ql_state_yield() a single branch. Once enabled, each ql_state_step()
+ * also reads the clock twice and updates the process-wide totals. Only
+ * steps which start while statistics are enabled are counted.
+ *
+ * @see ql_state_stats()
+ * @see ql_stats_total()
+ * @param enable Whether to collect statistics
+ * @return Whether statistics were enabled before
+ */
+bool
+ql_stats_enable(bool enable);
+
+/*
+ * Gets the runtime statistics of a qlState.
+ *
+ * The statistics cover the qlState since it was created, reset or taken
+ * from the pool by ql_state_new(). While the qlState is suspended, its
+ * suspended time includes the time since it last yielded. The statistics
+ * of a qlState being stepped by another thread may be slightly stale.
+ *
+ * @see ql_stats_enable()
+ * @param state The state object
+ * @param stats Where to store the statistics
+ */
+void
+ql_state_stats(const qlState *state, qlStats *stats);
+
+/*
+ * Gets the runtime statistics of all qlStates in the process.
+ *
+ * These are the sums over all qlStates, including those since freed, of
+ * their statistics while enabled. Time spent suspended is only added once
+ * a qlState is stepped again. The resumed field is the last time any
+ * qlState was stepped.
+ *
+ * @see ql_stats_enable()
+ * @param stats Where to store the statistics
+ */
+void
+ql_stats_total(qlStats *stats);
+
+/*
+ * Creates a scheduler which runs coroutines on a pool of worker threads.
+ *
+ * Each worker has its own run queue, from which idle workers steal, so the
+ * coroutines spread over all the workers. Workers which find nothing to run
+ * sleep until new coroutines are spawned.
+ *
+ * If workers is 0, one worker per online CPU is started. On Linux, this is
+ * one worker per CPU in the affinity mask of the process instead (see
+ * sched_getaffinity()), and each worker is pinned to its own CPU of the
+ * mask.
+ *
+ * A coroutine may run on a different worker after each yield. Thus it must
+ * not hold on to thread-local data (including errno) across ql_sched_yield().
+ * The scheduler is only available in builds with the pthread engine.
+ *
+ * The scheduler must be freed using the standard libsc conventions. Freeing
+ * it stops the workers (once their current coroutines yield) and frees all
+ * coroutines which haven't finished.
+ *
+ * @see ql_sched_spawn()
+ * @see ql_sched_wait()
+ * @param parent The memory parent (libsc)
+ * @param workers The number of worker threads, or 0 for one per CPU.
+ * @return The new scheduler or NULL on error.
+ */
+qlScheduler *
+ql_sched_new(void *parent, size_t workers);
+
+/*
+ * Spawns a coroutine on a scheduler.
+ *
+ * The qlFunction is called with param from one of the scheduler's workers.
+ * The engine and the stack pages are as for ql_state_new(). The qlState is
+ * owned by the scheduler: it is freed (or recycled) when func returns or
+ * calls ql_sched_exit(). The value returned by func is ignored.
+ *
+ * This may be called from any thread, including from within a coroutine on
+ * the scheduler (which queues the new coroutine on the current worker).
+ *
+ * @see ql_sched_new()
+ * @param sched The scheduler
+ * @param eng The name of the engine desired or NULL.
+ * @param func The function to call.
+ * @param pages The number of stack pages to pre-allocate.
+ * @param param The parameter to pass to func.
+ * @return true on success, false on error
+ */
+bool
+ql_sched_spawn(qlScheduler *sched, const char *eng, qlFunction *func,
+               size_t pages, qlParameter param);
+
+/*
+ * Yields a coroutine spawned by ql_sched_spawn() back to its scheduler.
+ *
+ * The coroutine is queued behind the other runnable coroutines of the worker
+ * and resumed later, possibly on another worker. Use this in place of
+ * ql_state_yield() in scheduled coroutines.
+ *
+ * @see ql_sched_spawn()
+ * @param state The state object
+ */
+void
+ql_sched_yield(qlState *state);
+
+/*
+ * Terminates a coroutine spawned by ql_sched_spawn().
+ *
+ * The qlState is freed by its worker. This function never returns.
+ *
+ * @see ql_sched_spawn()
+ * @param state The state object
+ */
+void
+ql_sched_exit(qlState *state);
+
+/*
+ * Suspends a coroutine spawned by ql_sched_spawn() for a while.
+ *
+ * The coroutine's worker goes on running other coroutines, and the
+ * coroutine is queued again once msec milliseconds have passed. Sleeping
+ * coroutines are kept in a hierarchical timing wheel, so arming and
+ * cancelling a timer costs the same however many are pending, and the
+ * workers handle the expired ones in batches. If msec is 0, this is
+ * ql_sched_yield().
+ *
+ * @see ql_sched_spawn()
+ * @see ql_io_deadline()
+ * @param state The state object
+ * @param msec The time to sleep, in milliseconds
+ */
+void
+ql_sched_sleep(qlState *state, unsigned int msec);
+
+/*
+ * Waits until all the coroutines of a scheduler have finished.
+ *
+ * This must not be called from a coroutine on the scheduler.
+ *
+ * @see ql_sched_spawn()
+ * @param sched The scheduler
+ */
+void
+ql_sched_wait(qlScheduler *sched);
+
+/*
+ * Creates a bounded channel, for passing qlParameters between coroutines.
+ *
+ * A channel buffers up to capacity items in a ring. Sending to a full
+ * channel, or receiving from an empty one, suspends the calling coroutine
+ * (which must have been spawned by ql_sched_spawn()) until the other side
+ * makes progress; other callers fail with EAGAIN instead. Items are passed
+ * as they are, so a pointer hands over the data it points to without a
+ * copy. When a receiver is already waiting, a sender stores the items
+ * straight into the receiver's buffer, and the receiver runs next on the
+ * sender's worker.
+ *
+ * A capacity of 0 makes an unbuffered channel (except with QL_CHAN_SPSC):
+ * items then only move from a sender to a waiting receiver.
+ *
+ * The channel must be freed using the standard libsc conventions, once no
+ * coroutine uses it anymore. Channels are only available in builds with
+ * the pthread engine.
+ *
+ * @see ql_chan_send()
+ * @see ql_chan_recv()
+ * @param parent The memory parent (libsc)
+ * @param capacity The number of items the channel can hold
+ * @param flags The QL_CHAN_* flags
+ * @return The new channel or NULL on error.
+ */
+qlChannel *
+ql_chan_new(void *parent, size_t capacity, qlFlags flags);
+
+/*
+ * Sends an item on a channel, waiting while the channel is full.
+ *
+ * @see ql_chan_new()
+ * @param state The state object (may be NULL)
+ * @param chan The channel
+ * @param item The item to send
+ * @return true on success, false on error (EAGAIN or EPIPE if closed)
+ */
+bool
+ql_chan_send(qlState *state, qlChannel *chan, qlParameter item);
+
+/*
+ * Receives an item from a channel, waiting while the channel is empty.
+ *
+ * The items sent before the channel was closed can still be received.
+ *
+ * @see ql_chan_new()
+ * @param state The state object (may be NULL)
+ * @param chan The channel
+ * @param item Storage for the item
+ * @return true on success, false on error (EAGAIN or EPIPE if closed)
+ */
+bool
+ql_chan_recv(qlState *state, qlChannel *chan, qlParameter *item);
+
+/*
+ * Sends many items on a channel, waiting as needed.
+ *
+ * This is ql_chan_send() for an array, but moves as many items as fit at
+ * once, so a pipeline stage pays for one wakeup per batch rather than one
+ * per item.
+ *
+ * @see ql_chan_send()
+ * @param state The state object (may be NULL)
+ * @param chan The channel
+ * @param items The items to send
+ * @param count The number of items
+ * @return The number of items sent (less than count on error)
+ */
+size_t
+ql_chan_send_many(qlState *state, qlChannel *chan, const qlParameter *items,
+                  size_t count);
+
+/*
+ * Receives up to count items from a channel, waiting for at least one.
+ *
+ * @see ql_chan_recv()
+ * @param state The state object (may be NULL)
+ * @param chan The channel
+ * @param items Storage for the items
+ * @param count The size of items
+ * @return The number of items received, or 0 on error
+ */
+size_t
+ql_chan_recv_many(qlState *state, qlChannel *chan, qlParameter *items,
+                  size_t count);
+
+/*
+ * Closes a channel.
+ *
+ * Sending then fails with EPIPE, and so does receiving once the channel is
+ * empty. Waiting coroutines are woken.
+ *
+ * @see ql_chan_new()
+ * @param chan The channel
+ */
+void
+ql_chan_close(qlChannel *chan);
+
+#ifndef _WIN32
+/*
+ * Reads from a file descriptor, suspending the coroutine until it's ready.
+ *
+ * This is read(), except that when called from a coroutine spawned by
+ * ql_sched_spawn(), the coroutine (instead of its worker) waits for the fd
+ * to become readable: the fd is registered with the scheduler's epoll
+ * reactor (and made non-blocking) the first time it is used. Idle workers
+ * harvest the reactor's events in batches and resume the waiting
+ * coroutines. Elsewhere (state is NULL or not scheduled), this simply
+ * blocks. Errors are reported as for read().
+ *
+ * File descriptors used with the ql_io_*() functions must be closed with
+ * ql_io_close(). At most one coroutine may wait to read, and one to write,
+ * each fd at a time. The ql_io_*() functions are available in builds with
+ * the scheduler, on systems with poll(); the reactor is only available in
+ * Linux builds (elsewhere, scheduled coroutines block their worker).
+ *
+ * @see ql_io_close()
+ * @param state The state object (may be NULL)
+ * @param fd The file descriptor
+ * @param buf The buffer to read into
+ * @param len The size of buf
+ * @return The number of bytes read, 0 on EOF or -1 on error
+ */
+ssize_t
+ql_io_read(qlState *state, int fd, void *buf, size_t len);
+
+/*
+ * Writes to a file descriptor, suspending the coroutine until it's ready.
+ *
+ * This is write(), except that the coroutine waits as in ql_io_read().
+ *
+ * @see ql_io_read()
+ * @param state The state object (may be NULL)
+ * @param fd The file descriptor
+ * @param buf The data to write
+ * @param len The size of buf
+ * @return The number of bytes written or -1 on error
+ */
+ssize_t
+ql_io_write(qlState *state, int fd, const void *buf, size_t len);
+
+/*
+ * Accepts a connection, suspending the coroutine until one arrives.
+ *
+ * This is accept(), except that the coroutine waits as in ql_io_read().
+ * When scheduled, the new socket is non-blocking.
+ *
+ * @see ql_io_read()
+ * @param state The state object (may be NULL)
+ * @param fd The listening socket
+ * @param addr Storage for the peer address (may be NULL)
+ * @param len The size of addr (may be NULL)
+ * @return The new socket or -1 on error
+ */
+int
+ql_io_accept(qlState *state, int fd, struct sockaddr *addr, socklen_t *len);
+
+/*
+ * Connects a socket, suspending the coroutine until the connection is made.
+ *
+ * This is connect(), except that the coroutine waits as in ql_io_read().
+ *
+ * @see ql_io_read()
+ * @param state The state object (may be NULL)
+ * @param fd The socket
+ * @param addr The address to connect to
+ * @param len The size of addr
+ * @return 0 on success or -1 on error
+ */
+int
+ql_io_connect(qlState *state, int fd, const struct sockaddr *addr,
+              socklen_t len);
+
+/*
+ * Sets a deadline for the waits of the ql_io_*() functions.
+ *
+ * Once msec milliseconds have passed, the ql_io_*() calls of the coroutine
+ * which would wait fail with ETIMEDOUT instead, until the deadline is
+ * changed. Scheduled coroutines wait on the scheduler's timer wheel, as in
+ * ql_sched_sleep(). Elsewhere, the deadline only bounds the wait for a
+ * non-blocking fd. If msec is 0, the deadline is removed.
+ *
+ * @see ql_io_read()
+ * @see ql_sched_sleep()
+ * @param state The state object
+ * @param msec The time left, in milliseconds, or 0 for no deadline
+ */
+void
+ql_io_deadline(qlState *state, unsigned int msec);
+
+/*
+ * Closes a file descriptor used with the ql_io_*() functions.
+ *
+ * This removes the fd from the reactor before closing it. No coroutine may
+ * be waiting on the fd.
+ *
+ * @see ql_io_read()
+ * @param state The state object (may be NULL)
+ * @param fd The file descriptor
+ * @return 0 on success or -1 on error
+ */
+int
+ql_io_close(qlState *state, int fd);
+#endif /* _WIN32 */
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
@@ -0,0 +1,631 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBQL_HPP_
+#define LIBQL_HPP_
+
+#include <libql.h>
+
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#if __cplusplus < 201703L
+#error "libql.hpp requires C++17"
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define LIBQL_COROUTINES 1
+#endif
+
+namespace ql {
+
+/*
+ * Thrown from yield() when a suspended coroutine is destroyed, so that the
+ * objects on its stack are destroyed too. A body which catches everything
+ * must rethrow it.
+ */
+struct unwind {};
+
+namespace detail {
+
+/* What a stackful coroutine yields while it waits for an awaitable. */
+inline char pending;
+
+#ifdef LIBQL_COROUTINES
+/* Finds the awaiter of an awaitable, as co_await does. */
+template <typename A>
+auto
+awaiter_of(A &&a, int) -> decltype(std::forward<A>(a).operator co_await())
+{
+  return std::forward<A>(a).operator co_await();
+}
+
+template <typename A>
+auto
+awaiter_of(A &&a, long) -> decltype(operator co_await(std::forward<A>(a)))
+{
+  return operator co_await(std::forward<A>(a));
+}
+
+template <typename A>
+A &&
+awaiter_of(A &&a, ...)
+{
+  return std::forward<A>(a);
+}
+
+template <typename A>
+using await_result_t =
+  decltype(awaiter_of(std::declval<A>(), 0).await_resume());
+
+/* The result of an awaitable, stored on the stackful stack. */
+template <typename T>
+struct await_slot {
+  std::optional<T>   value;
+  std::exception_ptr error;
+
+  template <typename U>
+  void set(U &&u) { value.emplace(std::forward<U>(u)); }
+  T get() { return std::move(*value); }
+};
+
+template <typename T>
+struct await_slot<T &> {
+  T                 *value = nullptr;
+  std::exception_ptr error;
+
+  void set(T &u) { value = std::addressof(u); }
+  T &get() { return *value; }
+};
+
+template <>
+struct await_slot<void> {
+  std::exception_ptr error;
+
+  void get() {}
+};
+
+/* Room for the frame of a bridge, on the stackful stack. Larger frames are
+ * allocated on the heap. */
+struct bridge_buffer {
+  alignas(std::max_align_t) unsigned char mem[512];
+};
+#endif /* LIBQL_COROUTINES */
+
+} /* namespace detail */
+
+/*
+ * A typed coroutine (C++17).
+ *
+ * The body is any callable, called as body(ctx) (or body(ctx, first) if
+ * Resume isn't void) where ctx is a coroutine::context&. The body hands
+ * values of type Yield to the resumer with ctx.yield(), which returns the
+ * Resume value passed to the next resume().
+ *
+ * The body is moved into the same allocation as the qlState (see
+ * ql_state_new_data()), and values are passed by reference between the
+ * stacks, so a coroutine costs a single allocation (none when it comes from
+ * the pool of ql_state_recycle()). A yielded value lives on the coroutine's
+ * stack: value() is only valid until the next resume(), and, with
+ * QL_FLAG_SHAREDSTACK, until another coroutine on the same stack runs.
+ *
+ * A coroutine is move-only. Destroying a suspended coroutine resumes it with
+ * ql::unwind thrown from yield(), so its stack unwinds; its qlState is then
+ * recycled. An exception thrown by the body is rethrown by resume().
+ *
+ * Thus, the general pattern is something like this:
+ *   ql::coroutine<int> counter([](ql::coroutine<int>::context &ctx) {
+ *     for (int i = 0; i < 3; i++)
+ *       ctx.yield(i);
+ *   });
+ *
+ *   while (counter.resume())
+ *     std::cout << counter.value() << std::endl;
+ *
+ * With C++20, the body can also suspend on any C++20 awaitable with
+ * ctx.await(), and a C++20 coroutine can co_await the next yield of a
+ * coroutine with next(). See context::await().
+ */
+template <typename Yield, typename Resume = void>
+class coroutine {
+  struct holder_base;
+  struct none {};
+
+  /* The argument types of yield() and resume(), even when void. */
+  using yield_type = std::conditional_t<std::is_void_v<Yield>, none, Yield>;
+  using resume_type =
+    std::conditional_t<std::is_void_v<Resume>, none, Resume>;
+
+public:
+  class context {
+    friend class coroutine;
+
+    qlState     *state_;
+    holder_base *holder_;
+
+    context(qlState *state, holder_base *holder)
+      : state_(state), holder_(holder) {}
+
+    Resume
+    suspend(void *value)
+    {
+      qlParameter param = value;
+
+      ql_state_yield(state_, &param);
+      if (holder_->unwinding)
+        throw unwind();
+
+      if constexpr (!std::is_void_v<Resume>)
+        return std::move(*static_cast<Resume *>(param));
+    }
+
+  public:
+    context(const context &) = delete;
+    context &operator=(const context &) = delete;
+
+    template <typename U = Yield,
+              std::enable_if_t<std::is_void_v<U>, int> = 0>
+    Resume
+    yield()
+    {
+      return suspend(nullptr);
+    }
+
+    Resume
+    yield(yield_type &value)
+    {
+      return suspend(std::addressof(value));
+    }
+
+    /* A temporary lives until yield() returns. */
+    Resume
+    yield(yield_type &&value)
+    {
+      return suspend(std::addressof(value));
+    }
+
+    Resume
+    yield(const yield_type &value)
+    {
+      yield_type copy(value);
+      return suspend(std::addressof(copy));
+    }
+
+#ifdef LIBQL_COROUTINES
+    /*
+     * Suspends the coroutine until a C++20 awaitable completes (C++20).
+     *
+     * This is co_await for a stackful coroutine: it returns the result of
+     * the awaitable, or throws its exception. If the awaitable isn't ready,
+     * the coroutine suspends and its resume() returns with pending() set.
+     * When the awaitable completes, the coroutine is stepped again right
+     * away, by whoever completed it, up to its next yield (or await); a
+     * C++20 coroutine waiting in next() is then resumed. The awaitable
+     * must complete on the thread driving the coroutine.
+     *
+     * The awaitable is awaited from a small C++20 coroutine, whose frame
+     * lives on this coroutine's stack, so awaiting allocates nothing.
+     */
+    template <typename A>
+    detail::await_result_t<A>
+    await(A &&awaitable)
+    {
+      using T = detail::await_result_t<A>;
+      detail::bridge_buffer buffer;
+      detail::await_slot<T> slot;
+      qlParameter param = &detail::pending;
+      auto b = bridge<A, T>(buffer, holder_, awaitable, slot);
+
+      if (!b.handle.done()) {
+        holder_->pending = true;
+        ql_state_yield(state_, &param);
+      }
+
+      b.handle.destroy();
+      if (slot.error)
+        std::rethrow_exception(slot.error);
+      return slot.get();
+    }
+#endif /* LIBQL_COROUTINES */
+
+    qlState *
+    state() const
+    {
+      return state_;
+    }
+  };
+
+  coroutine() noexcept : state_(nullptr) {}
+
+  /*
+   * Creates a coroutine running body. The engine, stack pages and flags are
+   * as for ql_state_new_flags(). Throws std::bad_alloc if the qlState can't
+   * be created (including for an unknown engine).
+   */
+  template <typename F,
+            std::enable_if_t<!std::is_same_v<std::decay_t<F>, coroutine>,
+                             int> = 0>
+  explicit coroutine(F &&body, size_t pages = 0,
+                     qlFlags flags = QL_FLAG_NONE, const char *eng = nullptr)
+    : state_(nullptr)
+  {
+    using holder_type = holder<std::decay_t<F>>;
+    static_assert(alignof(holder_type) <= alignof(std::max_align_t),
+                  "over-aligned coroutine bodies are not supported");
+
+    state_ = ql_state_new_data(nullptr, eng, entry, pages, flags,
+                               sizeof(holder_type));
+    if (!state_)
+      throw std::bad_alloc();
+
+    try {
+      ::new (ql_state_data(state_)) holder_type(state_,
+                                                std::forward<F>(body));
+    } catch (...) {
+      ql_state_recycle(nullptr, state_);
+      throw;
+    }
+  }
+
+  coroutine(coroutine &&other) noexcept
+    : state_(std::exchange(other.state_, nullptr)) {}
+
+  coroutine &
+  operator=(coroutine &&other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      state_ = std::exchange(other.state_, nullptr);
+    }
+
+    return *this;
+  }
+
+  coroutine(const coroutine &) = delete;
+  coroutine &operator=(const coroutine &) = delete;
+
+  ~coroutine()
+  {
+    reset();
+  }
+
+  /*
+   * Runs the coroutine until it yields or returns. The first resume()
+   * passes its value (if any) as the body's argument; later ones return it
+   * from yield(). Returns true if the coroutine yielded (see value()) or
+   * is pending(), in which case this does nothing.
+   */
+  template <typename U = Resume,
+            std::enable_if_t<std::is_void_v<U>, int> = 0>
+  bool
+  resume()
+  {
+    return step(nullptr);
+  }
+
+  bool
+  resume(resume_type value)
+  {
+    return step(std::addressof(value));
+  }
+
+  /* The value of the last yield(). */
+  template <typename U = Yield,
+            std::enable_if_t<!std::is_void_v<U>, int> = 0>
+  U &
+  value() const
+  {
+    return *static_cast<U *>(get_holder(state_)->value);
+  }
+
+  /* True while the coroutine waits in context::await(). */
+  bool
+  pending() const noexcept
+  {
+    return state_ && get_holder(state_)->pending;
+  }
+
+  /* True until the body has returned. */
+  explicit operator bool() const noexcept
+  {
+    return state_ && !get_holder(state_)->done;
+  }
+
+#ifdef LIBQL_COROUTINES
+  /*
+   * Awaits the next yield of the coroutine from a C++20 coroutine (C++20).
+   *
+   * co_await next() is resume() for C++20 coroutines: it returns true if
+   * the coroutine yielded, false if it returned. If the coroutine is
+   * pending() on an awaitable, the C++20 coroutine is suspended until the
+   * coroutine yields (or returns), and then resumed directly.
+   */
+  template <typename U = Resume,
+            std::enable_if_t<std::is_void_v<U>, int> = 0>
+  auto
+  next()
+  {
+    return next_awaiter(this, none());
+  }
+
+  auto
+  next(resume_type value)
+  {
+    return next_awaiter(this, std::move(value));
+  }
+#endif /* LIBQL_COROUTINES */
+
+  /*
+   * Destroys the body (unwinding it if suspended) and the qlState. The
+   * coroutine must not be pending().
+   */
+  void
+  reset() noexcept
+  {
+    qlParameter param = nullptr;
+    holder_base *h;
+
+    if (!state_)
+      return;
+
+    h = get_holder(state_);
+    if (h->pending)
+      std::terminate();
+
+    if (h->started && !h->done) {
+      h->unwinding = true;
+      while (ql_state_step(state_, &param))
+        continue;
+    }
+
+    h->~holder_base();
+    ql_state_recycle(nullptr, state_);
+    state_ = nullptr;
+  }
+
+  /* The underlying qlState, for use with the C API. */
+  qlState *
+  state() const noexcept
+  {
+    return state_;
+  }
+
+private:
+  /* Everything which must stay put while the coroutine object moves. */
+  struct holder_base {
+    qlState           *state;
+    void              *value = nullptr;
+    void              *driver = nullptr; /* Waiting in next(), if any */
+    std::exception_ptr error;
+    bool               started = false;
+    bool               done = false;
+    bool               pending = false;
+    bool               unwinding = false;
+
+    explicit holder_base(qlState *s) : state(s) {}
+    virtual ~holder_base() {}
+    virtual void run(context &ctx, void *first) = 0;
+
+    /* Steps the coroutine, without rethrowing its exception. */
+    void
+    advance(void *arg)
+    {
+      qlParameter param = arg;
+
+      started = true;
+      done = !ql_state_step(state, &param);
+      value = done ? nullptr : param;
+    }
+
+    void
+    rethrow()
+    {
+      if (done && error)
+        std::rethrow_exception(std::exchange(error, nullptr));
+    }
+  };
+
+  template <typename F>
+  struct holder : holder_base {
+    F body;
+
+    template <typename G>
+    holder(qlState *s, G &&g) : holder_base(s), body(std::forward<G>(g)) {}
+
+    void
+    run(context &ctx, void *first) override
+    {
+      if constexpr (std::is_void_v<Resume>)
+        body(ctx);
+      else
+        body(ctx, std::move(*static_cast<Resume *>(first)));
+    }
+  };
+
+  static holder_base *
+  get_holder(qlState *state)
+  {
+    return std::launder(static_cast<holder_base *>(ql_state_data(state)));
+  }
+
+  static qlParameter
+  entry(qlState *state, qlParameter param)
+  {
+    holder_base *h = get_holder(state);
+    context ctx(state, h);
+
+    try {
+      h->run(ctx, param);
+    } catch (const unwind &) {
+    } catch (...) {
+      h->error = std::current_exception();
+    }
+
+    return nullptr;
+  }
+
+  bool
+  step(void *value)
+  {
+    holder_base *h;
+
+    if (!state_)
+      return false;
+
+    h = get_holder(state_);
+    if (h->pending)
+      return true;
+    if (h->done)
+      return false;
+
+    h->advance(value);
+    h->rethrow();
+    return !h->done;
+  }
+
+#ifdef LIBQL_COROUTINES
+  /* Runs the awaiting part of context::await(). */
+  struct bridge_task {
+    struct promise_type;
+    std::coroutine_handle<promise_type> handle;
+
+    struct promise_type {
+      holder_base *holder;
+
+      template <typename... Args>
+      promise_type(detail::bridge_buffer &, holder_base *h, Args &&...)
+        : holder(h) {}
+
+      template <typename... Args>
+      static void *
+      operator new(size_t size, detail::bridge_buffer &buffer, Args &&...)
+      {
+        if (size <= sizeof(buffer.mem))
+          return buffer.mem;
+        return ::operator new(size);
+      }
+
+      static void
+      operator delete(void *mem, size_t size)
+      {
+        if (size > sizeof(detail::bridge_buffer::mem))
+          ::operator delete(mem);
+      }
+
+      struct final_awaiter {
+        bool await_ready() noexcept { return false; }
+        void await_resume() noexcept {}
+
+        /* Once the coroutine has yielded to wait for us, step it here, and
+         * then resume whoever awaits its next yield. The coroutine destroys
+         * this bridge and reuses the stack it was on, so nothing of the
+         * bridge may be touched after stepping: this returns void rather
+         * than a handle to transfer to, which would be read from the
+         * frame. */
+        void
+        await_suspend(std::coroutine_handle<promise_type> self) noexcept
+        {
+          holder_base *h = self.promise().holder;
+          void *driver;
+
+          if (!h->pending)
+            return;
+
+          h->pending = false;
+          h->advance(nullptr);
+          if (h->pending || !h->driver)
+            return;
+
+          driver = std::exchange(h->driver, nullptr);
+          std::coroutine_handle<>::from_address(driver).resume();
+        }
+      };
+
+      bridge_task
+      get_return_object()
+      {
+        return { std::coroutine_handle<promise_type>::from_promise(*this) };
+      }
+
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      final_awaiter final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept {}
+    };
+  };
+
+  template <typename A, typename T>
+  static bridge_task
+  bridge(detail::bridge_buffer &, holder_base *, A &awaitable,
+         detail::await_slot<T> &slot)
+  {
+    try {
+      if constexpr (std::is_void_v<T>)
+        co_await std::forward<A>(awaitable);
+      else
+        slot.set(co_await std::forward<A>(awaitable));
+    } catch (...) {
+      slot.error = std::current_exception();
+    }
+  }
+
+  class next_awaiter {
+    coroutine  *coro_;
+    resume_type arg_;
+
+  public:
+    next_awaiter(coroutine *coro, resume_type arg)
+      : coro_(coro), arg_(std::move(arg)) {}
+
+    bool
+    await_ready()
+    {
+      coro_->step(std::is_void_v<Resume> ? nullptr : std::addressof(arg_));
+      return !coro_->pending();
+    }
+
+    void
+    await_suspend(std::coroutine_handle<> h) noexcept
+    {
+      get_holder(coro_->state_)->driver = h.address();
+    }
+
+    bool
+    await_resume()
+    {
+      if (!coro_->state_)
+        return false;
+
+      get_holder(coro_->state_)->rethrow();
+      return bool(*coro_);
+    }
+  };
+#endif /* LIBQL_COROUTINES */
+
+  qlState *state_;
+};
+
+} /* namespace ql */
+
+#endif /* LIBQL_HPP_ */
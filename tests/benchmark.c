@@ -17,77 +17,299 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Measures, for every engine, the latency of:
+ *   create  - ql_state_new_flags()
+ *   first   - the first ql_state_step() (entering the qlFunction)
+ *   switch  - a ql_state_step()/ql_state_yield() round trip
+ *   destroy - sc_decref() of a finished qlState
+ *
+ * Each sample times one operation, except for switch: a round trip can be
+ * cheaper than reading the clock, so a sample times SWITCHES of them and
+ * records the mean. The clock's own overhead is subtracted. Percentiles
+ * are taken over the samples which follow the warmup.
+ *
+ * Usage: benchmark [-j] [-s] [-n samples] [-w warmup] [-c cpu] [-e engine]
+ *                  [-f flags]
+ *   -j  Print JSON (for regression tracking) instead of a table.
+ *   -s  Enable runtime statistics (ql_stats_enable()).
+ *   -c  Pin to this CPU (default: the current one; -1 to not pin).
+ *   -f  QL_FLAG_* bits for ql_state_new_flags().
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* sched_setaffinity(), sched_getcpu() */
+#endif
+
 #include <libql.h>
 
+#include <assert.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/time.h>
-#include <assert.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
-#define START 25
-#define YIELDS 5
-#define END (START * 1000)
+#ifdef CLOCK_MONOTONIC_RAW
+#define CLOCK    CLOCK_MONOTONIC_RAW
+#define CLOCKSTR "monotonic_raw"
+#else
+#define CLOCK    CLOCK_MONOTONIC
+#define CLOCKSTR "monotonic"
+#endif
 
-#define RFMT "%s,%u,%d.%06u,%u\n"
-#define FMT "%s-" RFMT
-#define DIFF(one, two) ((one > two) ? (one - two) : (two - one))
-#define SECONDS(stv, etv) ((unsigned int) (etv.tv_sec - stv.tv_sec - \
-	                   ((stv.tv_usec > etv.tv_usec) ? 1 : 0)))
-#define USECONDS(stv, etv) ((unsigned int) DIFF(etv.tv_usec, stv.tv_usec))
-#define TIME(stv, etv) SECONDS(stv, etv), USECONDS(stv, etv)
+#define SAMPLES  2000
+#define WARMUP   200
+#define SWITCHES 16
 
-void *(*int_malloc)(size_t size);
-void *(*int_realloc)(void *mem, size_t size);
-void *(*int_calloc)(size_t count, size_t size);
+enum { CREATE, FIRST, SWITCH, DESTROY, PHASES };
 
-qlParameter
-test_return(qlState *state, qlParameter param)
+static const char * const phases[PHASES] = {
+  "create", "first", "switch", "destroy"
+};
+
+typedef struct {
+  double mean;
+  double p50;
+  double p99;
+  double p999;
+  double max;
+} stats;
+
+static uint64_t overhead;
+
+static inline uint64_t
+now()
 {
-  return param;
+  struct timespec ts;
+
+  clock_gettime(CLOCK, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t
+elapsed(uint64_t start, uint64_t end)
+{
+  return end - start > overhead ? end - start - overhead : 0;
 }
 
-qlParameter
-test_yield(qlState *state, qlParameter param)
+/* The smallest time between two reads of the clock. */
+static uint64_t
+calibrate()
 {
-  int i;
-  for (i = 0; i < YIELDS - 1; i++)
+  uint64_t min = UINT64_MAX;
+
+  for (int i = 0; i < 10000; i++) {
+    uint64_t start = now(), end = now();
+    if (end - start < min)
+      min = end - start;
+  }
+
+  return min;
+}
+
+static qlParameter
+bench_func(qlState *state, qlParameter param)
+{
+  /* Yield until the stepper passes a non-NULL parameter. */
+  while (!param)
     ql_state_yield(state, &param);
+
   return param;
 }
 
+static int
+compare(const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static double
+percentile(const double *sorted, size_t count, double p)
+{
+  size_t i = (size_t) (p * (count - 1) + 0.5);
+  return sorted[i < count ? i : count - 1];
+}
+
+static void
+summarize(double *samples, size_t count, stats *s)
+{
+  double sum = 0;
+
+  for (size_t i = 0; i < count; i++)
+    sum += samples[i];
+
+  qsort(samples, count, sizeof(double), compare);
+  s->mean = sum / count;
+  s->p50 = percentile(samples, count, 0.50);
+  s->p99 = percentile(samples, count, 0.99);
+  s->p999 = percentile(samples, count, 0.999);
+  s->max = samples[count - 1];
+}
+
+/* Records samples + warmup samples of every phase for one engine. */
+static void
+measure(const char *eng, qlFlags flags, size_t samples, size_t warmup,
+        double *results[PHASES])
+{
+  for (size_t i = 0; i < warmup + samples; i++) {
+    qlParameter param = NULL;
+    uint64_t t[PHASES + 1];
+    qlState *state;
+    bool more;
+
+    t[0] = now();
+    state = ql_state_new_flags(NULL, eng, bench_func, 0, flags);
+    t[1] = now();
+    assert(state);
+
+    more = ql_state_step(state, &param);
+    t[2] = now();
+    assert(more);
+
+    for (int j = 0; j < SWITCHES; j++)
+      more = ql_state_step(state, &param);
+    t[3] = now();
+    assert(more);
+
+    param = (qlParameter) state;
+    more = ql_state_step(state, &param);
+    assert(!more);
+    (void) more; /* Only checked with assertions on */
+
+    t[4] = now();
+    sc_decref(NULL, state);
+    t[5] = now();
+
+    if (i < warmup)
+      continue;
+
+    results[CREATE][i - warmup] = elapsed(t[0], t[1]);
+    results[FIRST][i - warmup] = elapsed(t[1], t[2]);
+    results[SWITCH][i - warmup] = (double) elapsed(t[2], t[3]) / SWITCHES;
+    results[DESTROY][i - warmup] = elapsed(t[4], t[5]);
+  }
+}
+
+static int
+pin(int cpu)
+{
+#ifdef __linux__
+  cpu_set_t set;
+
+  if (cpu == -2)
+    cpu = sched_getcpu();
+  if (cpu < 0)
+    return -1;
+
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    return -1;
+  return cpu;
+#else
+  return -1;
+#endif
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s [-j] [-s] [-n samples] [-w warmup] [-c cpu] "
+                  "[-e engine] [-f flags]\n", prog);
+  exit(1);
+}
+
 int
 main(int argc, char **argv)
 {
-  struct timeval stv, etv;
+  size_t samples = SAMPLES, warmup = WARMUP;
   const char * const *engines;
+  const char *only = NULL;
+  double *results[PHASES];
+  qlFlags flags = QL_FLAG_NONE;
+  bool json = false, counting = false;
+  int cpu = -2, opt;
+  stats s;
+
+  while ((opt = getopt(argc, argv, "jsn:w:c:e:f:")) != -1) {
+    switch (opt) {
+    case 'j': json = true; break;
+    case 's': counting = true; break;
+    case 'n': samples = strtoul(optarg, NULL, 0); break;
+    case 'w': warmup = strtoul(optarg, NULL, 0); break;
+    case 'c': cpu = atoi(optarg); break;
+    case 'e': only = optarg; break;
+    case 'f': flags = strtoul(optarg, NULL, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (samples == 0)
+    usage(argv[0]);
 
-  for (unsigned int i = START; i <= END; i *= 10) {
-    gettimeofday(&stv, NULL);
-    for (unsigned int j = 0; j < i; j++)
-      i += (uintptr_t) test_return(NULL, NULL);
-    gettimeofday(&etv, NULL);
-    printf(RFMT, "return", i, TIME(stv, etv), 0);
+  for (int p = 0; p < PHASES; p++) {
+    results[p] = calloc(samples, sizeof(double));
+    assert(results[p]);
   }
 
+  ql_stats_enable(counting);
+  cpu = pin(cpu);
+  overhead = calibrate();
+
+  if (json)
+    printf("{\n  \"clock\": \"%s\",\n  \"overhead_ns\": %llu,\n"
+           "  \"cpu\": %d,\n  \"samples\": %zu,\n  \"warmup\": %zu,\n"
+           "  \"switches_per_sample\": %d,\n  \"flags\": %u,\n"
+           "  \"stats\": %s,\n  \"engines\": [", CLOCKSTR,
+           (unsigned long long) overhead, cpu, samples, warmup, SWITCHES,
+           flags, counting ? "true" : "false");
+  else
+    printf("# clock: %s (overhead %llu ns), cpu: %d, samples: %zu, "
+           "warmup: %zu, flags: 0x%02x, stats: %s\n"
+           "%-10s %-8s %10s %10s %10s %10s %10s\n",
+           CLOCKSTR, (unsigned long long) overhead, cpu, samples, warmup,
+           flags, counting ? "on" : "off",
+           "engine", "phase", "mean", "p50", "p99", "p99.9", "max");
+
   engines = ql_engine_list();
   assert(engines);
 
-  for (unsigned int i = 0; engines[i]; i++) {
-    qlParameter param;
-    qlState *state;
+  for (int i = 0, n = 0; engines[i]; i++) {
+    if (only && strcmp(only, engines[i]) != 0)
+      continue;
 
-    for (unsigned int j = START; j <= END; j *= 10) {
-      gettimeofday(&stv, NULL);
-      for (unsigned int k = 0; k < j / YIELDS; k++) {
-        state = ql_state_new(NULL, engines[i], test_yield, 0);
-        while (ql_state_step(state, &param))
-          continue;
-      }
-      gettimeofday(&etv, NULL);
-      printf(FMT, engines[i], "yield", j, TIME(stv, etv), j / YIELDS * 2);
+    measure(engines[i], flags, samples, warmup, results);
+
+    if (json)
+      printf("%s\n    {\n      \"engine\": \"%s\"", n++ ? "," : "",
+             engines[i]);
+
+    for (int p = 0; p < PHASES; p++) {
+      summarize(results[p], samples, &s);
+      if (json)
+        printf(",\n      \"%s\": { \"mean\": %.1f, \"p50\": %.1f, "
+               "\"p99\": %.1f, \"p99.9\": %.1f, \"max\": %.1f }",
+               phases[p], s.mean, s.p50, s.p99, s.p999, s.max);
+      else
+        printf("%-10s %-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               engines[i], phases[p], s.mean, s.p50, s.p99, s.p999, s.max);
     }
+
+    if (json)
+      printf("\n    }");
   }
 
+  if (json)
+    printf("\n  ]\n}\n");
+
+  for (int p = 0; p < PHASES; p++)
+    free(results[p]);
+  ql_state_pool_clear();
   return 0;
 }
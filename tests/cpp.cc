@@ -0,0 +1,191 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libql.hpp>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+/* Counts the allocations made through operator new. */
+static size_t allocations;
+
+void *
+operator new(size_t size)
+{
+  void *mem = malloc(size ? size : 1);
+
+  if (!mem)
+    throw std::bad_alloc();
+
+  allocations++;
+  return mem;
+}
+
+void
+operator delete(void *mem) noexcept
+{
+  free(mem);
+}
+
+void
+operator delete(void *mem, size_t) noexcept
+{
+  free(mem);
+}
+
+struct guard {
+  bool *destroyed;
+
+  ~guard()
+  {
+    *destroyed = true;
+  }
+};
+
+static void
+test_generator(const char *eng)
+{
+  using gen = ql::coroutine<int>;
+  int sum = 0, count = 0;
+
+  gen g([](gen::context &ctx) {
+    for (int i = 0; i < 10; i++)
+      ctx.yield(i);
+  }, 0, QL_FLAG_NONE, eng);
+
+  while (g.resume()) {
+    sum += g.value();
+    count++;
+  }
+
+  assert(count == 10 && sum == 45);
+  assert(!g);
+  assert(!g.resume());
+}
+
+/* Passes values both ways, by reference. */
+static void
+test_accumulator(const char *eng)
+{
+  using acc = ql::coroutine<std::string, std::string>;
+  bool destroyed = false;
+
+  {
+    acc a([&destroyed](acc::context &ctx, std::string first) {
+      guard g = { &destroyed };
+      std::string total = first;
+
+      for (;;)
+        total += ctx.yield(total);
+    }, 0, QL_FLAG_NONE, eng);
+
+    assert(a.resume("a") && a.value() == "a");
+    assert(a.resume("b") && a.value() == "ab");
+    assert(a.resume("c") && a.value() == "abc");
+
+    /* Moving keeps the coroutine suspended. */
+    acc b(std::move(a));
+    assert(!a && b);
+    assert(b.resume("d") && b.value() == "abcd");
+    assert(!destroyed);
+  }
+
+  /* Destroying a suspended coroutine unwinds its stack. */
+  assert(destroyed);
+}
+
+/* The body, with its captures, lives in the qlState's allocation. */
+static void
+test_allocations(const char *eng)
+{
+  using gen = ql::coroutine<void>;
+  std::unique_ptr<int> owned(new int(42));
+  char big[512] = { 0 };
+  qlState *state;
+  size_t before;
+  int seen = 0;
+
+  auto make = [eng, &seen](std::unique_ptr<int> p, const char (&b)[512]) {
+    return gen([p = std::move(p), b, &seen](gen::context &ctx) {
+      seen = *p + b[0];
+      ctx.yield();
+    }, 0, QL_FLAG_NONE, eng);
+  };
+
+  /* Make room in the pool. */
+  ql_state_pool_clear();
+
+  before = allocations;
+  {
+    gen g = make(std::move(owned), big);
+    assert(g.resume() && seen == 42);
+    assert(!g.resume());
+    state = g.state();
+  }
+  assert(allocations == before);
+
+  /* A finished coroutine's qlState goes back to the pool. */
+  gen g = make(std::unique_ptr<int>(new int(7)), big);
+  assert(g.state() == state);
+  assert(g.resume() && seen == 7);
+}
+
+static void
+test_exception(const char *eng)
+{
+  using gen = ql::coroutine<int>;
+  bool caught = false;
+
+  gen g([](gen::context &ctx) {
+    ctx.yield(1);
+    throw std::runtime_error("boom");
+  }, 0, QL_FLAG_NONE, eng);
+
+  assert(g.resume() && g.value() == 1);
+  try {
+    g.resume();
+  } catch (const std::runtime_error &e) {
+    caught = std::string(e.what()) == "boom";
+  }
+
+  assert(caught);
+  assert(!g);
+}
+
+int
+main()
+{
+  const char * const *engines = ql_engine_list();
+
+  assert(engines);
+  for (int i = 0; engines[i]; i++) {
+    printf("%s\n", engines[i]);
+    test_generator(engines[i]);
+    test_accumulator(engines[i]);
+    test_allocations(engines[i]);
+    test_exception(engines[i]);
+  }
+
+  ql_state_pool_clear();
+  return 0;
+}
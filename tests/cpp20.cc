@@ -0,0 +1,210 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libql.hpp>
+
+#include <cassert>
+#include <coroutine>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#ifndef LIBQL_COROUTINES
+#error "libql.hpp didn't enable C++20 coroutines"
+#endif
+
+/* Counts the allocations made through operator new. */
+static size_t allocations;
+
+void *
+operator new(size_t size)
+{
+  void *mem = malloc(size ? size : 1);
+
+  if (!mem)
+    throw std::bad_alloc();
+
+  allocations++;
+  return mem;
+}
+
+void
+operator delete(void *mem) noexcept
+{
+  free(mem);
+}
+
+void
+operator delete(void *mem, size_t) noexcept
+{
+  free(mem);
+}
+
+/* A single-threaded loop of handles to resume, which never allocates. */
+struct loop {
+  std::coroutine_handle<> queue[64];
+  size_t                  head = 0;
+  size_t                  tail = 0;
+
+  void
+  post(std::coroutine_handle<> h)
+  {
+    assert(tail - head < 64);
+    queue[tail++ % 64] = h;
+  }
+
+  void
+  run()
+  {
+    while (head < tail)
+      queue[head++ % 64].resume();
+  }
+
+  /* Completes on the next turn of the loop, with a value. */
+  struct tick {
+    loop *l;
+    int   value;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { l->post(h); }
+    int await_resume() { return value; }
+  };
+
+  /* Fails on the next turn of the loop. */
+  struct failure {
+    loop *l;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> h) { l->post(h); }
+    void await_resume() { throw std::runtime_error("failed"); }
+  };
+};
+
+/* A C++20 coroutine which starts at once and runs to the end. */
+struct task {
+  struct promise_type {
+    task get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { abort(); }
+  };
+};
+
+using gen = ql::coroutine<int>;
+
+/* Yields 0..9, waiting on the loop (and on a ready awaitable) between. */
+static gen
+make(loop &l, const char *eng)
+{
+  return gen([&l](gen::context &ctx) {
+    for (int i = 0; i < 10; i++) {
+      ctx.await(std::suspend_never());
+      ctx.yield(ctx.await(loop::tick { &l, i }));
+    }
+  }, 0, QL_FLAG_NONE, eng);
+}
+
+static task
+drive(gen &g, int &sum, bool &done)
+{
+  /* Not in the loop's condition: GCC 12 miscompiles co_await there. */
+  for (;;) {
+    bool more = co_await g.next();
+    if (!more)
+      break;
+    sum += g.value();
+  }
+  done = true;
+}
+
+/* A C++20 coroutine drives a stackful one, which waits on the loop. */
+static void
+test_drive(const char *eng)
+{
+  bool done = false;
+  int sum = 0;
+  loop l;
+
+  gen g = make(l, eng);
+  size_t before = allocations;
+  task t = drive(g, sum, done);
+  (void) t;
+
+  /* The driver's own frame is the only allocation. */
+  l.run();
+  assert(done && sum == 45);
+  assert(allocations <= before + 1);
+}
+
+/* Without a C++20 driver, the coroutine is pending until the loop runs. */
+static void
+test_pending(const char *eng)
+{
+  loop l;
+  int i;
+
+  gen g = make(l, eng);
+  for (i = 0; g.resume(); i++) {
+    assert(g.pending());
+    assert(g.resume());
+    l.run();
+    assert(!g.pending() && g.value() == i);
+  }
+
+  assert(i == 10);
+}
+
+/* The exception of an awaitable is thrown by await(). */
+static void
+test_failure(const char *eng)
+{
+  using check = ql::coroutine<bool>;
+  loop l;
+
+  check c([&l](check::context &ctx) {
+    try {
+      ctx.await(loop::failure { &l });
+      ctx.yield(false);
+    } catch (const std::runtime_error &) {
+      ctx.yield(true);
+    }
+  }, 0, QL_FLAG_NONE, eng);
+
+  assert(c.resume() && c.pending());
+  l.run();
+  assert(!c.pending() && c.value());
+}
+
+int
+main()
+{
+  const char * const *engines = ql_engine_list();
+
+  assert(engines);
+  for (int i = 0; engines[i]; i++) {
+    printf("%s\n", engines[i]);
+    test_drive(engines[i]);
+    test_pending(engines[i]);
+    test_failure(engines[i]);
+  }
+
+  ql_state_pool_clear();
+  return 0;
+}
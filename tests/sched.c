@@ -0,0 +1,632 @@
+/*
+ * libql - A coroutines library for C/C++
+ *
+ * Copyright 2011 Nathaniel McCallum <nathaniel@themccallums.org>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <libql.h>
+
+#include <libsc.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WITH_IO
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+#ifdef WITH_EPOLL
+#include <netinet/in.h>
+#endif
+
+#define TASKS  1000
+#define YIELDS 10
+
+static size_t done;
+static size_t exited;
+static qlScheduler *sched;
+
+static qlParameter
+child(qlState *state, qlParameter param)
+{
+  for (int i = 0; i < YIELDS; i++)
+    ql_sched_yield(state);
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  if ((uintptr_t) param % 2) {
+    __atomic_add_fetch(&exited, 1, __ATOMIC_RELAXED);
+    ql_sched_exit(state);
+  }
+
+  return NULL;
+}
+
+static qlParameter
+parent(qlState *state, qlParameter param)
+{
+  const char *eng = param;
+
+  /* Spawn from within the scheduler, too. */
+  for (uintptr_t i = 0; i < TASKS / 2; i++) {
+    assert(ql_sched_spawn(sched, eng, child, 0, (qlParameter) i));
+    if (i % 16 == 0)
+      ql_sched_yield(state);
+  }
+
+  return NULL;
+}
+
+#define SLEEPERS 2000
+
+static uint64_t
+now_msec()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static qlParameter
+sleeper(qlState *state, qlParameter param)
+{
+  unsigned int msec = (uintptr_t) param % 100;
+  uint64_t start = now_msec();
+
+  ql_sched_sleep(state, msec);
+  assert(now_msec() - start >= msec);
+
+  /* A second, shorter sleep goes through the wheel again. */
+  ql_sched_sleep(state, msec / 2);
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void
+test_sleep(size_t workers)
+{
+  uint64_t start = now_msec();
+
+  done = 0;
+  sched = ql_sched_new(NULL, workers);
+  assert(sched);
+
+  for (uintptr_t i = 0; i < SLEEPERS; i++)
+    assert(ql_sched_spawn(sched, NULL, sleeper, 0, (qlParameter) i));
+
+  ql_sched_wait(sched);
+  printf("sleep (workers: %zu): %zu done in %llu ms\n", workers, done,
+         (unsigned long long) (now_msec() - start));
+  assert(done == SLEEPERS);
+  sc_decref(NULL, sched);
+}
+
+#define ITEMS    10000
+#define STAGES   4
+#define BATCH    32
+
+typedef struct {
+  qlChannel *in;
+  qlChannel *out;
+  bool       batch;
+} stage;
+
+static uint64_t summed;
+
+static qlParameter
+producer(qlState *state, qlParameter param)
+{
+  stage *s = param;
+  qlParameter items[BATCH];
+  uintptr_t i = 1;
+
+  while (i <= ITEMS) {
+    size_t n = 0;
+
+    if (!s->batch) {
+      assert(ql_chan_send(state, s->out, (qlParameter) i++));
+      continue;
+    }
+
+    while (n < BATCH && i <= ITEMS)
+      items[n++] = (qlParameter) i++;
+    assert(ql_chan_send_many(state, s->out, items, n) == n);
+  }
+
+  ql_chan_close(s->out);
+  return NULL;
+}
+
+static qlParameter
+doubler(qlState *state, qlParameter param)
+{
+  stage *s = param;
+  qlParameter items[BATCH];
+  size_t n;
+
+  while ((n = ql_chan_recv_many(state, s->in, items, s->batch ? BATCH : 1))) {
+    for (size_t i = 0; i < n; i++)
+      items[i] = (qlParameter) ((uintptr_t) items[i] * 2);
+    assert(ql_chan_send_many(state, s->out, items, n) == n);
+  }
+
+  assert(errno == EPIPE);
+  ql_chan_close(s->out);
+  return NULL;
+}
+
+static qlParameter
+consumer(qlState *state, qlParameter param)
+{
+  stage *s = param;
+  qlParameter item;
+
+  while (ql_chan_recv(state, s->in, &item))
+    __atomic_add_fetch(&summed, (uintptr_t) item, __ATOMIC_RELAXED);
+
+  assert(errno == EPIPE);
+  return NULL;
+}
+
+/* Runs producer -> doubler x STAGES -> consumer(s). */
+static void
+test_chan(size_t workers, size_t capacity, qlFlags flags, bool batch)
+{
+  const uint64_t expect = (uint64_t) ITEMS * (ITEMS + 1) / 2 << STAGES;
+  qlChannel *chans[STAGES + 1];
+  stage stages[STAGES + 2];
+
+  summed = 0;
+  sched = ql_sched_new(NULL, workers);
+  assert(sched);
+
+  for (int i = 0; i <= STAGES; i++) {
+    chans[i] = ql_chan_new(sched, capacity, flags);
+    assert(chans[i]);
+  }
+
+  for (int i = 0; i < STAGES + 2; i++) {
+    stages[i].in = i > 0 ? chans[i - 1] : NULL;
+    stages[i].out = i <= STAGES ? chans[i] : NULL;
+    stages[i].batch = batch;
+    assert(ql_sched_spawn(sched, NULL, i == 0 ? producer :
+                                       i <= STAGES ? doubler : consumer,
+                          0, &stages[i]));
+  }
+
+  /* MPMC channels can have several receivers. */
+  if (!(flags & QL_CHAN_SPSC))
+    assert(ql_sched_spawn(sched, NULL, consumer, 0, &stages[STAGES + 1]));
+
+  ql_sched_wait(sched);
+  printf("chan (workers: %zu, capacity: %zu, flags: 0x%02x, batch: %d): "
+         "%llu\n", workers, capacity, flags, batch,
+         (unsigned long long) summed);
+  assert(summed == expect);
+  sc_decref(NULL, sched);
+}
+
+#ifdef WITH_EPOLL
+#define CLIENTS  64
+#define MESSAGES 16
+
+static struct sockaddr_in addr;
+static size_t echoed;
+
+static qlParameter
+echo(qlState *state, qlParameter param)
+{
+  int fd = (intptr_t) param;
+  char buf[64];
+  ssize_t n;
+
+  while ((n = ql_io_read(state, fd, buf, sizeof(buf))) > 0)
+    assert(ql_io_write(state, fd, buf, n) == n);
+
+  assert(n == 0);
+  assert(ql_io_close(state, fd) == 0);
+  return NULL;
+}
+
+static qlParameter
+server(qlState *state, qlParameter param)
+{
+  int lfd = (intptr_t) param;
+
+  for (int i = 0; i < CLIENTS; i++) {
+    int fd = ql_io_accept(state, lfd, NULL, NULL);
+    assert(fd >= 0);
+    assert(ql_sched_spawn(sched, NULL, echo, 0, (qlParameter) (intptr_t) fd));
+  }
+
+  assert(ql_io_close(state, lfd) == 0);
+  return NULL;
+}
+
+static qlParameter
+client(qlState *state, qlParameter param)
+{
+  char buf[32];
+  int fd;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  assert(ql_io_connect(state, fd, (struct sockaddr *) &addr,
+                       sizeof(addr)) == 0);
+
+  for (int i = 0; i < MESSAGES; i++) {
+    size_t len = snprintf(buf, sizeof(buf), "%p:%d", param, i);
+    assert(ql_io_write(state, fd, buf, len) == len);
+
+    for (size_t got = 0; got < len; ) {
+      char in[32];
+      ssize_t n = ql_io_read(state, fd, in, len - got);
+      assert(n > 0);
+      assert(memcmp(in, buf + got, n) == 0);
+      got += n;
+    }
+
+    __atomic_add_fetch(&echoed, 1, __ATOMIC_RELAXED);
+  }
+
+  assert(ql_io_close(state, fd) == 0);
+  return NULL;
+}
+
+static void
+test_io(size_t workers)
+{
+  socklen_t len = sizeof(addr);
+  int lfd;
+
+  echoed = 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(lfd >= 0);
+  assert(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  assert(listen(lfd, CLIENTS) == 0);
+  assert(getsockname(lfd, (struct sockaddr *) &addr, &len) == 0);
+
+  sched = ql_sched_new(NULL, workers);
+  assert(sched);
+
+  assert(ql_sched_spawn(sched, NULL, server, 0,
+                        (qlParameter) (intptr_t) lfd));
+  for (uintptr_t i = 0; i < CLIENTS; i++)
+    assert(ql_sched_spawn(sched, NULL, client, 0, (qlParameter) i));
+
+  ql_sched_wait(sched);
+  printf("io (workers: %zu): %zu echoed\n", workers, echoed);
+  assert(echoed == CLIENTS * MESSAGES);
+  sc_decref(NULL, sched);
+}
+
+/* Connects to a listener whose backlog is full, after registering the
+ * socket (which makes it look writable), so the connect can't complete. */
+static qlParameter
+stalled(qlState *state, qlParameter param)
+{
+  struct sockaddr_in peer;
+  socklen_t len = sizeof(peer);
+  int fd;
+  char c;
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(fd >= 0);
+  assert(ql_io_read(state, fd, &c, 1) == -1);
+
+  /* Let the worker harvest the edge of the registration. */
+  ql_sched_sleep(state, 10);
+
+  ql_io_deadline(state, 100);
+  assert(ql_io_connect(state, fd, (struct sockaddr *) &addr,
+                       sizeof(addr)) == -1);
+  assert(errno == ETIMEDOUT);
+  assert(getpeername(fd, (struct sockaddr *) &peer, &len) == -1);
+  assert(errno == ENOTCONN);
+
+  assert(ql_io_close(state, fd) == 0);
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+static void
+test_backlog()
+{
+  socklen_t len = sizeof(addr);
+  int lfd, fds[8];
+
+  done = 0;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(lfd >= 0);
+  assert(bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  assert(listen(lfd, 0) == 0);
+  assert(getsockname(lfd, (struct sockaddr *) &addr, &len) == 0);
+
+  /* Fill the backlog; the connects beyond it stay in SYN_SENT. */
+  for (int i = 0; i < 8; i++) {
+    fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    assert(fds[i] >= 0);
+    connect(fds[i], (struct sockaddr *) &addr, sizeof(addr));
+  }
+  usleep(10000);
+
+  sched = ql_sched_new(NULL, 1);
+  assert(sched);
+  assert(ql_sched_spawn(sched, NULL, stalled, 0, NULL));
+  ql_sched_wait(sched);
+  sc_decref(NULL, sched);
+
+  printf("backlog: %zu connects timed out\n", done);
+  assert(done == 1);
+
+  for (int i = 0; i < 8; i++)
+    close(fds[i]);
+  close(lfd);
+}
+#endif
+
+#ifdef WITH_IO
+static qlParameter
+timeout(qlState *state, qlParameter param)
+{
+  int fd = (intptr_t) param;
+  uint64_t start = now_msec();
+  char c;
+
+  ql_io_deadline(state, 20);
+  assert(ql_io_read(state, fd, &c, 1) == -1);
+  assert(errno == ETIMEDOUT);
+  assert(now_msec() - start >= 20);
+
+  __atomic_add_fetch(&done, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/* Outside a scheduler's reactor, deadlines are kept by waiting in poll(),
+ * which blocks the (worker) thread. */
+static void
+test_blocking()
+{
+  qlState *state;
+  int fds[2];
+
+  done = 0;
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+  assert(fcntl(fds[1], F_SETFL, O_NONBLOCK) == 0);
+
+  state = ql_state_new(NULL, NULL, timeout, 0);
+  assert(state);
+  timeout(state, (qlParameter) (intptr_t) fds[0]);
+  sc_decref(NULL, state);
+
+  sched = ql_sched_new(NULL, 1);
+  assert(sched);
+  assert(ql_sched_spawn(sched, NULL, timeout, 0,
+                        (qlParameter) (intptr_t) fds[1]));
+  ql_sched_wait(sched);
+  sc_decref(NULL, sched);
+
+  printf("blocking: %zu timed out\n", done);
+  assert(done == 2);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+#endif
+
+#ifdef WITH_EPOLL
+static qlParameter
+stuck(qlState *state, qlParameter param)
+{
+  char c;
+
+  ql_io_deadline(state, 60000);
+  ql_io_read(state, (intptr_t) param, &c, 1);
+  abort(); /* Freed before the deadline */
+}
+
+static void
+test_deadline()
+{
+  int fds[2];
+
+  done = 0;
+  assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  sched = ql_sched_new(NULL, 2);
+  assert(sched);
+  assert(ql_sched_spawn(sched, NULL, timeout, 0,
+                        (qlParameter) (intptr_t) fds[0]));
+  ql_sched_wait(sched);
+
+  /* Coroutines waiting with a deadline are freed with their scheduler. */
+  assert(ql_sched_spawn(sched, NULL, stuck, 0,
+                        (qlParameter) (intptr_t) fds[1]));
+  usleep(10000);
+  sc_decref(NULL, sched);
+
+  printf("deadline: %zu timed out\n", done);
+  assert(done == 1);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+#endif
+
+/* Counts on its own stack, across steps from different threads. */
+static qlParameter
+counter(qlState *state, qlParameter param)
+{
+  uintptr_t count = (uintptr_t) param;
+
+  for (int i = 0; i < YIELDS; i++) {
+    param = (qlParameter) ++count;
+    ql_state_yield(state, &param);
+    count += (uintptr_t) param;
+  }
+
+  return (qlParameter) count;
+}
+
+static void *
+step_elsewhere(void *arg)
+{
+  qlState *state = arg;
+  qlParameter param = (qlParameter) 100;
+
+  assert(ql_state_attach(state));
+  assert(!ql_state_attach(state));
+  assert(ql_state_step(state, &param));
+  assert(ql_state_detach(state));
+  return param;
+}
+
+/* Moves a suspended state to a new thread for each step. */
+static void
+test_migrate(const char *eng, qlFlags flags)
+{
+  qlParameter param = NULL;
+  pthread_t thread;
+  qlState *state;
+  void *rslt;
+
+  state = ql_state_new_flags(NULL, eng, counter, 0, flags);
+  assert(state);
+  assert(ql_state_step(state, &param));
+
+  if (flags & ql_engine_get_flags(eng) & QL_FLAG_SHAREDSTACK) {
+    assert(!ql_state_detach(state));
+    ql_state_free(state);
+    return;
+  }
+
+  for (uintptr_t i = 1; i < YIELDS; i++) {
+    assert(ql_state_detach(state));
+    assert(!ql_state_detach(state));
+    assert(pthread_create(&thread, NULL, step_elsewhere, state) == 0);
+    assert(pthread_join(thread, &rslt) == 0);
+    assert(ql_state_attach(state));
+    assert((uintptr_t) rslt == 1 + i * 101);
+  }
+
+  param = NULL;
+  assert(!ql_state_step(state, &param));
+  assert((uintptr_t) param == 1 + (YIELDS - 1) * 101);
+  ql_state_free(state);
+  printf("%s (flags: 0x%02x): migrated %d times\n", eng, flags, YIELDS - 1);
+}
+
+int
+main()
+{
+  const char * const *engines;
+
+  engines = ql_engine_list();
+  assert(engines);
+
+  for (size_t workers = 0; workers < 3; workers++) {
+    for (int i = 0; engines[i]; i++) {
+      done = exited = 0;
+
+      sched = ql_sched_new(NULL, workers);
+      assert(sched);
+
+      assert(ql_sched_spawn(sched, engines[i], parent, 0,
+                            (qlParameter) engines[i]));
+      for (uintptr_t j = 0; j < TASKS / 2; j++)
+        assert(ql_sched_spawn(sched, engines[i], child, 0, (qlParameter) j));
+
+      ql_sched_wait(sched);
+      printf("%s (workers: %zu): %zu done, %zu exited\n",
+             engines[i], workers, done, exited);
+      assert(done == TASKS);
+      assert(exited == TASKS / 2);
+      sc_decref(NULL, sched);
+    }
+  }
+
+  for (int i = 0; engines[i]; i++) {
+    test_migrate(engines[i], QL_FLAG_NONE);
+    test_migrate(engines[i], QL_FLAG_NOSIGMASK);
+    test_migrate(engines[i], QL_FLAG_SHAREDSTACK);
+    test_migrate(engines[i], QL_FLAG_NOFPU);
+  }
+
+  for (size_t workers = 0; workers < 3; workers++)
+    test_sleep(workers);
+
+  for (size_t workers = 1; workers < 3; workers++) {
+    test_chan(workers, 0, QL_CHAN_NONE, false);
+    test_chan(workers, 64, QL_CHAN_NONE, false);
+    test_chan(workers, 64, QL_CHAN_NONE, true);
+    test_chan(workers, 64, QL_CHAN_SPSC, false);
+    test_chan(workers, 64, QL_CHAN_SPSC, true);
+  }
+
+  /* Outside a coroutine, channels never wait. */
+  {
+    qlChannel *chan = ql_chan_new(NULL, 1, QL_CHAN_SPSC);
+    qlParameter item;
+
+    assert(chan);
+    assert(!ql_chan_recv(NULL, chan, &item) && errno == EAGAIN);
+    assert(ql_chan_send(NULL, chan, (qlParameter) 1));
+    assert(!ql_chan_send(NULL, chan, (qlParameter) 2) && errno == EAGAIN);
+    ql_chan_close(chan);
+    assert(ql_chan_recv(NULL, chan, &item) && item == (qlParameter) 1);
+    assert(!ql_chan_recv(NULL, chan, &item) && errno == EPIPE);
+    sc_decref(NULL, chan);
+  }
+
+#ifdef WITH_IO
+  test_blocking();
+#endif
+#ifdef WITH_EPOLL
+  for (size_t workers = 0; workers < 3; workers++)
+    test_io(workers);
+  test_backlog();
+  test_deadline();
+#endif
+
+  /* Freeing a busy scheduler frees its coroutines, sleeping or not. */
+  sched = ql_sched_new(NULL, 2);
+  assert(sched);
+  for (uintptr_t j = 0; j < TASKS; j++) {
+    assert(ql_sched_spawn(sched, NULL, child, 0, (qlParameter) j));
+    assert(ql_sched_spawn(sched, NULL, sleeper, 0,
+                          (qlParameter) (j * 1000 + 99)));
+  }
+  sc_decref(NULL, sched);
+
+  ql_state_pool_clear();
+  return 0;
+}
@@ -24,7 +24,9 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define DOUBLE(v) v = (qlParameter) (((uintptr_t) v) * 2);
 #define LASTVAL   ((qlParameter) 0x1000)
@@ -75,33 +77,567 @@ level0(qlState *state, qlParameter param)
   return param;
 }
 
+static void
+run(qlState *state)
+{
+  qlParameter param = (qlParameter) 0x1;
+
+  while (ql_state_step(state, &param)) {
+    printf("\tyielded : %p\n", param);
+    DOUBLE(param);
+  }
+
+  printf("\treturned: %p\n", param);
+  assert(param == LASTVAL);
+}
+
+/* Steps two states in lock-step, so that their stacks are live at once. */
+static void
+run_pair(qlState *a, qlState *b)
+{
+  qlParameter pa = (qlParameter) 0x1, pb = (qlParameter) 0x1;
+  bool ra, rb;
+
+  do {
+    ra = ql_state_step(a, &pa);
+    rb = ql_state_step(b, &pb);
+    assert(ra == rb);
+    assert(pa == pb);
+    if (ra) {
+      DOUBLE(pa);
+      DOUBLE(pb);
+    }
+  } while (ra);
+
+  printf("\tpair    : %p\n", pa);
+  assert(pa == LASTVAL);
+}
+
+/* Recurses param levels deep, each with a kilobyte on the stack. */
+static qlParameter
+deep(qlState *state, qlParameter param)
+{
+  volatile char buf[1024];
+  uintptr_t depth = (uintptr_t) param;
+
+  memset((char *) buf, depth, sizeof(buf));
+  if (depth > 1)
+    deep(state, (qlParameter) (depth - 1));
+  else
+    ql_state_yield(state, NULL);
+
+  return (qlParameter) (uintptr_t) buf[depth % sizeof(buf)];
+}
+
+/* Measures the stack of a 16 kilobyte recursion, then sizes one by it. */
+static void
+run_stack(const char *eng, qlFlags flags)
+{
+  qlParameter param = (qlParameter) 16;
+  qlState *state;
+  size_t used;
+
+  state = ql_state_new_flags(NULL, eng, deep, 64,
+                             flags | QL_FLAG_STACKPAINT);
+  assert(state);
+  assert(ql_state_step(state, &param));
+  used = ql_state_stack_used(state);
+  assert(!ql_state_step(state, &param));
+
+  /* A lazy stack is gone once the function returns. */
+  if (flags & QL_FLAG_LAZYSTACK)
+    assert(ql_state_stack_used(state) == 0);
+  else
+    assert(ql_state_stack_used(state) == used);
+  printf("\tstack   : %zu bytes used\n", used);
+  sc_decref(NULL, state);
+
+  /* Only stacks of the state's own can be measured. */
+  if (used == 0) {
+    assert(!(ql_engine_get_flags(eng) & QL_FLAG_STACKPAINT) ||
+           (flags & QL_FLAG_SHAREDSTACK));
+    return;
+  }
+
+  assert(used >= 16 * 1024);
+  assert(ql_stack_advise(deep) * sysconf(_SC_PAGESIZE) >= used);
+
+  state = ql_state_new_flags(NULL, eng, deep, 1, flags | QL_FLAG_STACKAUTO);
+  assert(state);
+  param = (qlParameter) 16;
+  assert(ql_state_step(state, &param));
+  assert(ql_state_stack_used(state) >= 16 * 1024);
+  assert(!ql_state_step(state, &param));
+  sc_decref(NULL, state);
+}
+
+/* Counts the steps and yields of a run, per state and in total. */
+static void
+run_stats(qlState *state)
+{
+  qlStats before, after, stats;
+
+  ql_stats_total(&before);
+  assert(!ql_stats_enable(true));
+  run(state);
+  assert(ql_stats_enable(false));
+  ql_stats_total(&after);
+
+  ql_state_stats(state, &stats);
+  printf("\tstats   : %llu steps, %llu yields\n", stats.steps, stats.yields);
+  assert(stats.steps == 4);
+  assert(stats.yields == 3);
+  assert(stats.resumed > 0);
+  assert(after.steps - before.steps == 4);
+  assert(after.yields - before.yields == 3);
+  assert(after.running - before.running == stats.running);
+
+  /* A reset starts over; disabled, nothing is counted. */
+  assert(ql_state_reset(state, level0));
+  ql_state_stats(state, &stats);
+  assert(stats.steps == 0 && stats.running == 0);
+  run(state);
+  ql_state_stats(state, &stats);
+  assert(stats.steps == 0);
+}
+
+static qlState *pinger, *ponger, *sink;
+
+/* Passes 1, 2 and 3 to ponger and yields the sum of the replies. Then
+ * passes 100 to the sink and returns what comes back. */
+static qlParameter
+ping(qlState *state, qlParameter param)
+{
+  uintptr_t sum = 0;
+
+  for (uintptr_t i = 1; i <= 3; i++) {
+    param = (qlParameter) i;
+    if (!ql_state_transfer(state, ponger, &param))
+      return NULL;
+    sum += (uintptr_t) param;
+  }
+
+  param = (qlParameter) sum;
+  ql_state_yield(state, &param);
+
+  param = (qlParameter) 100;
+  assert(ql_state_transfer(state, sink, &param));
+  return param;
+}
+
+static qlParameter
+pong(qlState *state, qlParameter param)
+{
+  for (;;) {
+    DOUBLE(param);
+    assert(ql_state_transfer(state, pinger, &param));
+  }
+
+  return NULL;
+}
+
+/* Adds one, then returns. */
+static qlParameter
+drain(qlState *state, qlParameter param)
+{
+  param = (qlParameter) ((uintptr_t) param + 1);
+  ql_state_yield(state, &param);
+  return (qlParameter) ((uintptr_t) param + 1);
+}
+
+/* Switches between states without going through the stepper. */
+static void
+run_transfer(const char *eng, qlFlags flags)
+{
+  qlParameter param = NULL;
+
+  pinger = ql_state_new_flags(NULL, eng, ping, 0, flags);
+  ponger = ql_state_new_flags(NULL, eng, pong, 0, flags);
+  sink = ql_state_new_flags(NULL, eng, drain, 0, flags);
+  assert(pinger && ponger && sink);
+
+  /* States on shared stacks can't transfer. */
+  if (flags & ql_engine_get_flags(eng) & QL_FLAG_SHAREDSTACK) {
+    assert(!ql_state_step(pinger, &param) && !param);
+    goto out;
+  }
+
+  /* ping and pong bounce three times, then ping yields. */
+  assert(ql_state_step(pinger, &param));
+  assert((uintptr_t) param == 12);
+
+  /* The sink yields in ping's place, so ping's step returns. */
+  assert(ql_state_step(pinger, &param));
+  assert((uintptr_t) param == 101);
+
+  param = (qlParameter) 5;
+  assert(!ql_state_step(sink, &param));
+  assert((uintptr_t) param == 6);
+
+  param = (qlParameter) 7;
+  assert(!ql_state_step(pinger, &param));
+  assert((uintptr_t) param == 7);
+  printf("\ttransfer: ok\n");
+
+  /* A state which returns in another's place ends the step too. */
+  assert(ql_state_reset(pinger, ping));
+  assert(ql_state_reset(sink, drain));
+  assert(ql_state_step(pinger, &param));
+  assert(ql_state_step(sink, &param));
+  assert(ql_state_step(pinger, &param));
+  assert((uintptr_t) param == 101);
+  assert(!ql_state_reset(pinger, ping));
+  assert(ql_state_reset(sink, drain));
+
+out:
+  sc_decref(NULL, sink);
+  sc_decref(NULL, ponger);
+  sc_decref(NULL, pinger);
+}
+
+/* Steps a batch of sinks: each adds one, yields, adds one and returns. */
+static void
+run_many(const char *eng, qlFlags flags)
+{
+  qlState *states[5];
+  qlParameter params[5] = { 0, (qlParameter) 10, 0, (qlParameter) 30, 0 };
+  bool results[5];
+  size_t i;
+
+  for (i = 0; i < 5; i++) {
+    states[i] = i == 2 ? NULL : ql_state_new_flags(NULL, eng, drain, 0, flags);
+    assert(i == 2 || states[i]);
+  }
+
+  assert(ql_state_step_many(states, params, 5, results) == 4);
+  for (i = 0; i < 5; i++)
+    assert(results[i] == (i != 2));
+  assert((uintptr_t) params[1] == 11 && (uintptr_t) params[3] == 31);
+
+  assert(ql_state_step_many(states, params, 5, results) == 0);
+  for (i = 0; i < 5; i++)
+    assert(!results[i]);
+  assert((uintptr_t) params[1] == 12 && (uintptr_t) params[3] == 32);
+  assert((uintptr_t) params[0] == 2 && params[2] == 0);
+
+  /* Without parameters or results. */
+  for (i = 0; i < 5; i++)
+    assert(!states[i] || ql_state_reset(states[i], drain));
+  assert(ql_state_step_many(states, NULL, 5, NULL) == 4);
+  assert(ql_state_step_many(states, NULL, 5, NULL) == 0);
+
+  ql_state_free_many(states, 5);
+  printf("\tstep many: ok\n");
+}
+
+static int cleanups, cleaned;
+
+/* Appends its digit to cleanups, to check the order handlers run in. */
+static void
+cleanup_note(void *arg)
+{
+  cleanups = cleanups * 10 + (int) (uintptr_t) arg;
+  cleaned++;
+}
+
+/* Yields (and never gets past it) inside two handlers, and pops a third. */
+static qlParameter
+hold(qlState *state, qlParameter param)
+{
+  qlCleanup outer, inner, popped;
+
+  ql_state_cleanup_push(state, &outer, cleanup_note, (void *) 1);
+  ql_state_cleanup_push(state, &popped, cleanup_note, (void *) 3);
+  ql_state_cleanup_pop(state, true);
+  ql_state_cleanup_push(state, &inner, cleanup_note, (void *) 2);
+  ql_state_yield(state, &param);
+  ql_state_yield(state, &param);
+  abort();
+  return NULL;
+}
+
+/* Cancels suspended states, running their handlers on their stacks. */
+static void
+run_cancel(const char *eng, qlFlags flags)
+{
+  qlParameter param = NULL;
+  qlState *states[16];
+  size_t i;
+
+  states[0] = ql_state_new_flags(NULL, eng, hold, 0, flags);
+  assert(states[0]);
+  assert(!ql_state_cancel(states[0]));
+
+  cleanups = 0;
+  assert(ql_state_step(states[0], &param));
+  assert(cleanups == 3);
+  assert(ql_state_cancel(states[0]));
+  assert(cleanups == 321);
+  assert(!ql_state_cancel(states[0]));
+
+  /* A cancelled state is finished, and can be reused. */
+  assert(ql_state_reset(states[0], level0));
+  run(states[0]);
+  assert(ql_state_reset(states[0], hold));
+  assert(ql_state_step(states[0], &param));
+  assert(ql_state_step(states[0], &param));
+
+  /* Freeing a suspended state cancels it. */
+  cleanups = 0;
+  sc_decref(NULL, states[0]);
+  assert(cleanups == 21);
+
+  for (i = 0; i < sizeof(states) / sizeof(*states); i++) {
+    states[i] = ql_state_new_flags(NULL, eng, i % 2 ? hold : level0, 0, flags);
+    assert(states[i]);
+    assert(ql_state_step(states[i], &param));
+  }
+
+  cleaned = 0;
+  ql_state_free_many(states, sizeof(states) / sizeof(*states));
+  assert(cleaned == 16);
+  printf("\tcancel: ok\n");
+}
+
+/* A bump allocator over a static buffer, which is released all at once. */
+typedef struct {
+  char   mem[256 * 1024] __attribute__ ((aligned(4096)));
+  size_t used;
+  size_t calls;
+} arena;
+
+static void *
+arena_alloc(void *ctx, size_t size, size_t align)
+{
+  arena *a = ctx;
+  size_t start = (a->used + align - 1) & ~(align - 1);
+
+  if (start + size > sizeof(a->mem))
+    return NULL;
+
+  a->used = start + size;
+  a->calls++;
+  return a->mem + start;
+}
+
+/* States and stacks come from an arena, and then from a slab. */
+static void
+run_alloc(const char *eng, qlFlags flags)
+{
+  static arena a;
+  const qlAllocator arena_allocator = { arena_alloc, NULL, &a };
+  size_t size = ql_allocator_size(eng, 8, flags, 64);
+  qlState *state, *other, *states[2];
+  qlSlab *slab;
+
+  a.used = a.calls = 0;
+  assert(!ql_allocator_set(&arena_allocator));
+  state = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  assert(state);
+  assert(a.calls == 1 && a.used == size);
+  assert((char *) ql_state_data(state) > a.mem &&
+         (char *) ql_state_data(state) < a.mem + a.used);
+  run(state);
+
+  /* Nothing is pooled, since the arena's memory may go at any time. */
+  ql_state_recycle(NULL, state);
+  state = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  assert(state && a.calls == 2);
+  run(state);
+  ql_state_free(state);
+  assert(ql_allocator_set(NULL) == &arena_allocator);
+
+  slab = ql_slab_new(NULL, size, 2);
+  assert(slab);
+  ql_allocator_set(ql_slab_allocator(slab));
+  state = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  other = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  assert(state && other);
+  run_pair(state, other);
+
+  /* The slab hands a freed block out again, but has no bigger ones. */
+  ql_state_free(other);
+  assert(ql_state_new_data(NULL, eng, level0, 8, flags, 64) == other);
+  if (ql_allocator_size(eng, 1000, flags, 64) > size)
+    assert(!ql_state_new_data(NULL, eng, level0, 1000, flags, 64));
+  assert(ql_state_reset(state, level0));
+  run_pair(state, other);
+
+  /* A recycled state goes back to the pool of its allocator. */
+  ql_state_recycle(NULL, state);
+  assert(ql_state_new_data(NULL, eng, level0, 8, flags, 64) == state);
+
+  /* Freeing many states gives all their blocks back to the slab. */
+  states[0] = state;
+  states[1] = other;
+  ql_state_free_many(states, 2);
+  state = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  other = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  assert(state && other);
+  assert(state == states[0] || state == states[1]);
+  assert(other == states[0] || other == states[1]);
+  ql_state_free(state);
+  ql_state_free(other);
+  ql_allocator_set(NULL);
+
+  ql_state_pool_clear();
+  sc_decref(NULL, slab);
+
+  /* Huge page and NUMA slabs carve blocks out of chunks of their own. */
+  slab = ql_slab_new_flags(NULL, size, 2, QL_SLAB_HUGEPAGES | QL_SLAB_NUMA);
+  assert(slab);
+  ql_allocator_set(ql_slab_allocator(slab));
+  state = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  other = ql_state_new_data(NULL, eng, level0, 8, flags, 64);
+  assert(state && other);
+  assert(((uintptr_t) state & (sysconf(_SC_PAGESIZE) - 1)) == 0);
+  run_pair(state, other);
+
+  ql_state_free(other);
+  assert(ql_state_new_data(NULL, eng, level0, 8, flags, 64) == other);
+  ql_state_free(state);
+  ql_state_free(other);
+  ql_allocator_set(NULL);
+  sc_decref(NULL, slab);
+}
+
+#ifdef __x86_64__
+/* Round toward zero, in MXCSR and in the x87 control word. */
+#define MXCSR_RZ 0x6000
+#define FPUCW_RZ 0x0c00
+
+static uint32_t
+get_mxcsr()
+{
+  uint32_t mxcsr;
+  __asm__ volatile ("stmxcsr %0" : "=m" (mxcsr));
+  return mxcsr;
+}
+
+static void
+set_mxcsr(uint32_t mxcsr)
+{
+  __asm__ volatile ("ldmxcsr %0" : : "m" (mxcsr));
+}
+
+static uint16_t
+get_fpucw()
+{
+  uint16_t fpucw;
+  __asm__ volatile ("fnstcw %0" : "=m" (fpucw));
+  return fpucw;
+}
+
+static void
+set_fpucw(uint16_t fpucw)
+{
+  __asm__ volatile ("fldcw %0" : : "m" (fpucw));
+}
+
+/* Changes the rounding mode, and checks it still holds once resumed. */
+static qlParameter
+fpu_round(qlState *state, qlParameter param)
+{
+  uint32_t mxcsr = get_mxcsr() | MXCSR_RZ;
+  uint16_t fpucw = get_fpucw() | FPUCW_RZ;
+
+  set_mxcsr(mxcsr);
+  set_fpucw(fpucw);
+  ql_state_yield(state, &param);
+  assert(get_mxcsr() == mxcsr && get_fpucw() == fpucw);
+  return param;
+}
+
+/* The fcontext engine keeps the FPU control state of the stepper and of the
+ * coroutine apart, unless QL_FLAG_NOFPU lets them share it. */
+static void
+run_fpu(qlFlags flags)
+{
+  uint32_t mxcsr = get_mxcsr();
+  uint16_t fpucw = get_fpucw();
+  bool shared = flags & QL_FLAG_NOFPU;
+  qlParameter param = NULL;
+  qlState *state;
+
+  assert(!(mxcsr & MXCSR_RZ) && !(fpucw & FPUCW_RZ));
+  state = ql_state_new_flags(NULL, "fcontext", fpu_round, 0, flags);
+  assert(state);
+
+  assert(ql_state_step(state, &param));
+  assert(get_mxcsr() == (shared ? mxcsr | MXCSR_RZ : mxcsr));
+  assert(get_fpucw() == (shared ? fpucw | FPUCW_RZ : fpucw));
+
+  assert(!ql_state_step(state, &param));
+  assert(get_mxcsr() == (shared ? mxcsr | MXCSR_RZ : mxcsr));
+  assert(get_fpucw() == (shared ? fpucw | FPUCW_RZ : fpucw));
+
+  set_mxcsr(mxcsr);
+  set_fpucw(fpucw);
+  sc_decref(NULL, state);
+  printf("\tfpu: ok\n");
+}
+#endif
+
 int
 main()
 {
   /* NOTE: We alternate stepN() to test resuming/returning from
    * different points in the stack. */
+  const qlFlags flags[] = { QL_FLAG_NONE, QL_FLAG_NOSIGMASK,
+                           QL_FLAG_MMAPSTACK, QL_FLAG_SHAREDSTACK,
+                           QL_FLAG_NOFPU, QL_FLAG_LAZYSTACK,
+                           QL_FLAG_LAZYSTACK | QL_FLAG_SHAREDSTACK };
   const char * const *engines;
 
   engines = ql_engine_list();
   assert(engines);
+  assert(ql_engine_get_flags(NULL) == ql_engine_get_flags(engines[0]));
+  assert(ql_engine_get_flags("nonexistent") == QL_FLAG_NONE);
 
   for (int i = 0; engines[i]; i++) {
-    qlParameter param = (qlParameter) 0x1;
-    qlState *state;
+    printf("\n%s supports flags 0x%02x\n", engines[i],
+           ql_engine_get_flags(engines[i]));
+    for (int j = 0; j < sizeof(flags) / sizeof(*flags); j++) {
+      qlState *state, *recycled;
 
-    printf("\n%s\n", engines[i]);
-    state = ql_state_new(NULL, engines[i], level0, 0);
-    assert(state);
+      printf("\n%s (flags: 0x%02x)\n", engines[i], flags[j]);
+      state = ql_state_new_flags(NULL, engines[i], level0, 0, flags[j]);
+      assert(state);
+      run(state);
 
-    while (ql_state_step(state, &param)) {
-      printf("\tyielded : %p\n", param);
-      DOUBLE(param);
-    }
+      /* Run the same state again, after a reset. */
+      assert(ql_state_reset(state, level0));
+      run(state);
 
-    printf("\treturned: %p\n", param);
-    sc_decref(NULL, state);
-    assert(param == LASTVAL);
+      /* Recycling should hand back the same state. */
+      ql_state_recycle(NULL, state);
+      recycled = ql_state_new_flags(NULL, engines[i], level0, 0, flags[j]);
+      assert(recycled == state);
+      run(recycled);
+
+      /* Interleave two states. */
+      state = ql_state_new_flags(NULL, engines[i], level0, 0, flags[j]);
+      assert(state);
+      assert(ql_state_reset(recycled, level0));
+      run_pair(state, recycled);
+
+      assert(ql_state_reset(recycled, level0));
+      run_stats(recycled);
+      sc_decref(NULL, recycled);
+      sc_decref(NULL, state);
+
+      run_stack(engines[i], flags[j]);
+      run_alloc(engines[i], flags[j]);
+      run_transfer(engines[i], flags[j]);
+      run_cancel(engines[i], flags[j]);
+      run_many(engines[i], flags[j]);
+#ifdef __x86_64__
+      if (strcmp(engines[i], "fcontext") == 0)
+        run_fpu(flags[j]);
+#endif
+    }
   }
 
+  ql_state_pool_clear();
   return 0;
 }